@@ -0,0 +1,330 @@
+#!/usr/bin/perl
+use Getopt::Std;
+use FileHandle;
+use IPC::Open2;
+use Time::HiRes qw(clock_gettime CLOCK_MONOTONIC);
+
+#######################################################################
+# bench.pl - Shell benchmark driver
+#
+# The driver runs a shell program as a child, feeds it generated
+# command streams and measures how fast it gets through them. Unlike
+# sdriver.pl it never sleeps: it either writes a whole stream at once
+# and times the shell until its output reaches end of file, or sends
+# one command at a time and waits for the next prompt.
+#
+# Workloads:
+#     fg        <n> foreground ./mystamp commands, streamed
+#     bg        <n> background ./mystamp commands in bursts of <b>,
+#               each burst followed by a foreground one, streamed
+#     mixed     <n>/4 rounds of a foreground and a background command,
+#               ./myint 0 (killed by SIGINT) and ./mystop 0 (stopped
+#               by SIGTSTP) followed by fg %<jid>, one at a time
+#     latency   <n> foreground ./mystamp commands, one at a time
+#     startup   <n> runs of "<shell> -c ./mystamp", then <n> runs of
+#               "<shell> -c true", each a new shell (not in the default
+#               list; it also works with -r /bin/sh)
+#
+# ./mystamp prints the CLOCK_MONOTONIC time it started running. In the
+# latency workload that gives the time from writing a command line
+# until the program runs ("exec") and from the program's exit until
+# the shell prints its next prompt ("reap"). In the startup workload,
+# it gives the time from starting the shell until its first exec
+# ("exec"); "total" is how long a whole "-c true" run takes.
+#
+# Each result is one line of tab-separated key=value pairs, appended
+# to the output file. With -r, the same workloads are run against a
+# reference shell and the two are compared.
+######################################################################
+
+#
+# usage - print help message and terminate
+#
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-h] -s <shellprog> [-a <args>] [-r <refshell>] [-o <file>] [-n <n>] [-b <b>] [-w <workloads>]\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h            Print this message\n";
+    printf STDERR "  -s <shell>    Shell program to benchmark\n";
+    printf STDERR "  -a <args>     Shell arguments\n";
+    printf STDERR "  -r <shell>    Reference shell to compare against\n";
+    printf STDERR "  -o <file>     Append results to <file> (default bench.out)\n";
+    printf STDERR "  -n <n>        Commands per workload (default 1000)\n";
+    printf STDERR "  -b <b>        Background burst size (default 8)\n";
+    printf STDERR "  -w <list>     Comma-separated workloads (default fg,bg,mixed,latency;\n";
+    printf STDERR "                also startup)\n";
+    die "\n" ;
+}
+
+# Parse the command line arguments
+getopts('hs:a:r:o:n:b:w:');
+if ($opt_h) {
+    usage();
+}
+if (!$opt_s) {
+    usage("Missing required -s argument");
+}
+$shellargs = $opt_a;
+$outfile = $opt_o ? $opt_o : "bench.out";
+$ncmds = $opt_n ? $opt_n : 1000;
+$burst = $opt_b ? $opt_b : 8;
+@workloads = split(/,/, $opt_w ? $opt_w : "fg,bg,mixed,latency");
+$timeout = 30;
+
+foreach $prog ($opt_s, $opt_r, "./mystamp", "./myint", "./mystop") {
+    next if (!$prog);
+    -x $prog
+	or die "$0: ERROR: $prog not found or not executable\n";
+}
+
+#
+# now - CLOCK_MONOTONIC time in seconds
+#
+sub now
+{
+    return clock_gettime(CLOCK_MONOTONIC);
+}
+
+#
+# percentile - the p'th percentile of a sorted list
+#
+sub percentile
+{
+    my ($p, @v) = @_;
+    return 0 if (!@v);
+    my $i = int($p * @v + 0.999999) - 1;
+    $i = 0 if ($i < 0);
+    return $v[$i];
+}
+
+#
+# start_shell - run the shell with the given extra arguments
+#
+sub start_shell
+{
+    my ($shell, $args) = @_;
+    my $pid = open2(\*Reader, \*Writer, "$shell $args");
+    Writer->autoflush();
+    return $pid;
+}
+
+#
+# run_stream - write all of @lines to the shell at once and read its
+#     output until end of file. Returns the elapsed time and the output.
+#
+sub run_stream
+{
+    my ($shell, @lines) = @_;
+    my ($start, $writer, $out);
+
+    $start = now();
+    $pid = start_shell($shell, "$shellargs -p");
+    if (($writer = fork()) == 0) {
+	close Reader;
+	print Writer @lines;
+	close Writer;
+	exit(0);
+    }
+    close Writer;
+    local $/;
+    $out = <Reader>;
+    close Reader;
+    waitpid($pid, 0);
+    waitpid($writer, 0);
+    return (now() - $start, $out);
+}
+
+#
+# expect - read the shell's output until $pattern matches, and return
+#     what was read up to and including the match
+#
+sub expect
+{
+    my ($pattern) = @_;
+    my ($rin, $buf, $i);
+
+    until (($i = ($inbuf =~ $pattern) ? $+[0] : 0)) {
+	$rin = '';
+	vec($rin, fileno(Reader), 1) = 1;
+	select($rin, undef, undef, $timeout) > 0
+	    or die "$0: ERROR: timed out waiting for the shell\n";
+	sysread(Reader, $buf, 65536) > 0
+	    or die "$0: ERROR: shell exited unexpectedly\n";
+	$inbuf .= $buf;
+    }
+    $buf = substr($inbuf, 0, $i);
+    $inbuf = substr($inbuf, $i);
+    return $buf;
+}
+
+#
+# command - send one command line and wait for the next prompt
+#
+sub command
+{
+    my ($line) = @_;
+    print Writer "$line\n";
+    return expect(qr/tsh> /);
+}
+
+#
+# run_once - run "<shell> <args> -c <command>" to completion and return
+#     its output
+#
+sub run_once
+{
+    my ($shell, $command) = @_;
+    my ($out);
+
+    open(ONCE, "-|", $shell, split(' ', $shellargs), "-c", $command)
+	or die "$0: ERROR: Couldn't run $shell: $!\n";
+    local $/;
+    $out = <ONCE>;
+    close(ONCE);
+    return $out;
+}
+
+#
+# bench_shell - run every workload against one shell
+#
+sub bench_shell
+{
+    my ($shell) = @_;
+    my (%res, @lines, $i, $t, $out, $errors, $pid, $t0, $stamp, @exec, @reap, @total);
+
+    foreach $w (@workloads) {
+	@lines = ();
+	$errors = 0;
+	if ($w eq "fg") {
+	    push(@lines, "./mystamp\n") for (1..$ncmds);
+	    ($t, $out) = run_stream($shell, @lines);
+	    $errors = $ncmds - (() = $out =~ /^mystamp /mg);
+	}
+	elsif ($w eq "bg") {
+	    for ($i = 0; $i < $ncmds; $i++) {
+		push(@lines, ($i % ($burst+1) == $burst) ? "./mystamp\n" : "./mystamp &\n");
+	    }
+	    ($t, $out) = run_stream($shell, @lines);
+	    $errors = $ncmds - (() = $out =~ /^mystamp /mg);
+	}
+	elsif ($w eq "mixed" || $w eq "latency") {
+	    $inbuf = '';
+	    @exec = @reap = ();
+	    $t = now();
+	    $pid = start_shell($shell, $shellargs);
+	    expect(qr/tsh> /);
+	    for ($i = 0; $i < $ncmds; $i++) {
+		if ($w eq "latency" || $i % 4 == 0) {
+		    $t0 = now();
+		    $out = command("./mystamp");
+		    if ($out =~ /^mystamp (\d+)$/m) {
+			$stamp = $1 / 1e9;
+			push(@exec, $stamp - $t0);
+			push(@reap, now() - $stamp);
+		    }
+		    else {
+			$errors++;
+		    }
+		}
+		elsif ($i % 4 == 1) {
+		    command("./mystamp &");
+		}
+		elsif ($i % 4 == 2) {
+		    $out = command("./myint 0");
+		    $errors++ if ($out !~ /terminated by signal 2/);
+		}
+		else {
+		    $out = command("./mystop 0");
+		    if ($out =~ /Job \[(\d+)\] \(\d+\) stopped/) {
+			command("fg %$1");
+		    }
+		    else {
+			$errors++;
+		    }
+		}
+	    }
+	    close Writer;
+	    waitpid($pid, 0);
+	    close Reader;
+	    $t = now() - $t;
+	}
+	elsif ($w eq "startup") {
+	    @exec = @total = ();
+	    $t = now();
+	    for ($i = 0; $i < $ncmds; $i++) {
+		$t0 = now();
+		$out = run_once($shell, "./mystamp");
+		if ($out =~ /^mystamp (\d+)$/m) {
+		    push(@exec, $1 / 1e9 - $t0);
+		}
+		else {
+		    $errors++;
+		}
+	    }
+	    for ($i = 0; $i < $ncmds; $i++) {
+		$t0 = now();
+		run_once($shell, "true");
+		push(@total, now() - $t0);
+	    }
+	    $t = now() - $t;
+	}
+	else {
+	    die "$0: ERROR: unknown workload $w\n";
+	}
+
+	$res{$w} = sprintf("shell=%s\tworkload=%s\tcommands=%d\tseconds=%.3f\tcmds_per_sec=%.0f\terrors=%d",
+			   $shell, $w, $ncmds, $t, $ncmds / $t, $errors);
+	if ($w eq "latency" || $w eq "startup") {
+	    @exec = sort { $a <=> $b } @exec;
+	    @reap = sort { $a <=> $b } @reap;
+	    @total = sort { $a <=> $b } @total;
+	    foreach $m ($w eq "latency" ? (["exec", \@exec], ["reap", \@reap]) :
+			(["exec", \@exec], ["total", \@total])) {
+		foreach $p (50, 90, 99) {
+		    $res{$w} .= sprintf("\t%s_p%d_us=%.1f", $m->[0], $p,
+					percentile($p / 100, @{$m->[1]}) * 1e6);
+		}
+		$res{$w} .= sprintf("\t%s_max_us=%.1f", $m->[0], $m->[1][-1] * 1e6);
+	    }
+	}
+	print OUT "$res{$w}\n";
+	print "$res{$w}\n";
+    }
+    return %res;
+}
+
+#
+# field - one value from a result line
+#
+sub field
+{
+    my ($res, $key) = @_;
+    return ($res =~ /(?:^|\t)$key=([^\t]*)/) ? $1 : undef;
+}
+
+open OUT, ">>$outfile"
+    or die "$0: ERROR: Couldn't open output file $outfile: $!\n";
+OUT->autoflush();
+printf OUT "# %s\n", scalar localtime;
+
+%mine = bench_shell($opt_s);
+if ($opt_r) {
+    %ref = bench_shell($opt_r);
+
+    # Compare throughput and latency against the reference shell
+    printf "\n%-10s %-14s %12s %12s %8s\n", "workload", "metric", $opt_s, $opt_r, "ratio";
+    foreach $w (@workloads) {
+	foreach $k ("cmds_per_sec", "exec_p50_us", "exec_p99_us", "reap_p50_us", "reap_p99_us",
+		    "total_p50_us", "total_p99_us") {
+	    $x = field($mine{$w}, $k);
+	    $y = field($ref{$w}, $k);
+	    next if (!defined($x) || !defined($y));
+	    printf "%-10s %-14s %12s %12s %8.2f\n", $w, $k, $x, $y, $y > 0 ? $x / $y : 0;
+	    printf OUT "compare\tworkload=%s\tmetric=%s\tshell=%s\tref=%s\tratio=%.3f\n",
+	        $w, $k, $x, $y, $y > 0 ? $x / $y : 0;
+	}
+    }
+}
+close OUT;
+exit;
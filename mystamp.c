@@ -0,0 +1,20 @@
+/*
+ * mystamp.c - A handy program for benchmarking your tiny shell
+ *
+ * usage: mystamp
+ * Prints "mystamp <t>", where <t> is the CLOCK_MONOTONIC time in
+ * nanoseconds at which it started running, and exits at once.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int main(int argc, char **argv)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    printf("mystamp %lld\n", ts.tv_sec * 1000000000LL + ts.tv_nsec);
+    exit(0);
+}
@@ -4,6 +4,7 @@
  * 	Name: Unnati Parekh
  *	ID: 201501406@daiict.ac.in
  */
+#define _GNU_SOURCE         /* pipe2, F_SETPIPE_SZ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,27 +13,67 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <errno.h>
+#include <time.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <stdint.h>
+#include <limits.h>
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
-#define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
+#define ARENABLOCK 65536  /* bytes in a command arena block */
+#define MAXJOBS      16   /* initial job list size (grows on demand) */
 #define MAXJID    1<<16   /* max job ID */
+#define MAXEVENTS    64   /* max epoll events handled per wakeup */
+#define MAXTIMERS    16   /* max pending event loop timers */
+#define PATHBUCKETS  64   /* buckets in the command path cache */
+#define BUILTIN_BITS  6   /* log2 of the builtin hash table size */
+#define BUILTIN_SEED  0xb /* gives every builtin name its own bucket */
+#define NOTERING    256   /* child status records queued for notify_drain */
+#define NOTEBATCH    32   /* job notifications written per writev */
+#define MAXDONE      16   /* finished jobs remembered for jobs -l and time */
+#define HISTBUCKETS  40   /* latency histogram buckets, bucket i is [2^i, 2^(i+1)) ns */
+#define SUBST     '\001' /* parseline's marks around a $? or $NAME expanded when */
+#define QSUBST    '\005' /*     the command runs, opened with QSUBST if it was quoted */
+#define GLOBSTAR  '\002' /* parseline's marks for an unquoted *, */
+#define GLOBONE   '\003' /*     ? */
+#define GLOBSET   '\004' /*     and [ */
+#define ASSIGN    '\006' /* parseline's mark for the = of a literal NAME= */
+#define DIRCACHE     16   /* directory listings kept for pathname expansion */
+#define VARBUCKETS  256   /* buckets in the shell variable table */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
 #define FG 1    /* running in foreground */
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
+#define QU 4    /* queued, waiting for a free run slot */
 
 /* 
- * Jobs states: FG (foreground), BG (background), ST (stopped)
+ * Jobs states: FG (foreground), BG (background), ST (stopped),
+ *     QU (queued)
  * Job state transitions and enabling actions:
  *     FG -> ST  : ctrl-z
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
+ *     QU -> BG  : a run slot frees up
+ *     QU -> FG  : fg command
+ *     QU -> ST  : kill -STOP (it stays unstarted)
+ *     ST -> QU  : bg command or kill -CONT, if it never started
  * At most 1 job can be in the FG state.
  */
 
@@ -43,15 +84,357 @@ int verbose = 0;            /* if true, print additional output */
 int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 
+struct usage_t {            /* Resources used by a process or job */
+    long long utime;        /* user CPU time, in us */
+    long long stime;        /* system CPU time, in us */
+    long maxrss;            /* peak resident set size, in KB */
+    long minflt;            /* minor page faults */
+    long majflt;            /* major page faults */
+    long nvcsw;             /* voluntary context switches */
+    long nivcsw;            /* involuntary context switches */
+};
+
+struct proc_t {             /* One process of a job (a pipeline stage) */
+    pid_t pid;              /* process ID */
+    int pidfd;              /* pidfd while the process is unreaped, else -1 */
+    int done;               /* true once the process has been reaped */
+    int status;             /* its wait status, once done */
+};
+
+struct ring_t {             /* Output of a job started with &! */
+    int fd;                 /* read end of the job's stdout and stderr, -1 at EOF */
+    int wfd;                /* write end, until the job is launched */
+    int memfd;              /* the ring: the last size bytes written */
+    size_t size;            /* capacity of the ring */
+    long long total;        /* bytes written so far; total % size is the head */
+};
+size_t ringsize = 65536;    /* -R: bytes of output kept per &! job */
+
+struct cmdstr_t {           /* A command line in the string store */
+    int refs;               /* jobs and donejobs[] entries sharing it */
+    int len;                /* strlen(text) */
+    char text[];            /* the line, with its newline */
+};
+
+/*
+ * A job is split in two. The job struct has what the job list scans
+ * and the signal handlers look at, so a scan touches 20 bytes a job;
+ * the rest is in a jobinfo struct at the same index of jobinfo[].
+ */
 struct job_t {              /* The job struct */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID (also the process group ID) */
     int jid;                /* job ID [1, 2, ...] */
-    int state;              /* UNDEF, BG, FG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    int state;              /* UNDEF, BG, FG, ST, or QU */
+    int prio;               /* queued jobs with a higher prio start first */
+    int next;               /* next free slot while the slot is unused */
+};
+struct schedattr_t {        /* how a job's processes are scheduled */
+    int flags;              /* SA_ flags: which of the rest are set */
+    int nice;               /* nice value */
+    int policy;             /* SCHED_OTHER, SCHED_BATCH or SCHED_IDLE */
+    int ioprio;             /* I/O class and level, as for ioprio_set */
+};
+#define SA_NICE   1         /* schedattr_t.nice is set */
+#define SA_POLICY 2         /* schedattr_t.policy is set */
+#define SA_IOPRIO 4         /* schedattr_t.ioprio is set */
+#define IOPRIO_CLASS_SHIFT 13 /* ioprio_set(2) values: class << shift | level */
+#define IOPRIO_WHO_PROCESS 1
+int demote;                 /* -d: bg demotes a job to SCHED_BATCH and idle I/O */
+
+struct jobinfo_t {          /* The rest of a job */
+    int nprocs;             /* number of processes in procs[] */
+    int nlive;              /* processes not yet reaped */
+    struct proc_t *procs;   /* the job's processes, procs[0].pid == pid */
+    long long start;        /* CLOCK_MONOTONIC time the job was added */
+    struct usage_t usage;   /* resources used by its reaped processes */
+    int *exitp;             /* if set, gets the wait status when it ends */
+    struct cmdstr_t *cmd;   /* command line */
+    struct ring_t *ring;    /* its output, if it was started with &! */
+    struct place_t *place;  /* CPUs it is placed on, NULL if not placed */
+    struct schedattr_t sched; /* its scheduling class, from a prefix or prio */
+    struct cgroup_t *cg;    /* its cgroup, NULL if it hasn't one */
+    struct queued_t *queued; /* what a queued job will run, NULL once it starts */
+};
+struct queued_t {           /* a queued job, as it was when it was queued */
+    char **argv;            /* its words, expanded: prefixes, then each stage */
+    int bg;                 /* 2 if it was started with &! */
+    char **envp;            /* the exported variables */
+    int cwdfd;              /* O_PATH descriptor of the working directory */
+};
+struct job_t *jobs;         /* The job list (grown by addjob) */
+struct jobinfo_t *jobinfo;  /* jobinfo[i] is the rest of jobs[i] */
+int maxjobs;                /* number of slots in jobs[] */
+int freejob = -1;           /* head of the list of unused slots */
+int fgjob = -1;             /* slot of the foreground job, -1 if none */
+int jobcount[QU+1];         /* number of jobs in each state */
+int maxrunning = -1;        /* -j: jobs run at once before & queues, 0 = no limit */
+int queueprio;              /* last priority given to a queued job by bg */
+
+struct donejob_t {          /* A recently finished job */
+    int jid;                /* its job ID */
+    pid_t pid;              /* its PID */
+    int status;             /* wait status of its last stage */
+    long long start, end;   /* when it was added and when it finished */
+    struct usage_t usage;   /* resources used by all of its processes */
+    struct cmdstr_t *cmd;   /* its command line */
+    struct ring_t *ring;    /* its output, if it was started with &! */
 };
-struct job_t jobs[MAXJOBS]; /* The job list */
+struct donejob_t donejobs[MAXDONE]; /* ring of the last MAXDONE finished jobs */
+int ndone;                  /* jobs recorded in donejobs[] so far */
+int *jidmap;                /* jid -> slot, -1 if the jid is unused */
+int jidcap;                 /* number of entries in jidmap[] */
+struct pident_t {           /* pidhash entry: which job a process is in */
+    pid_t pid;              /* process ID, 0 if the bucket is empty */
+    int slot;               /* slot of its job in jobs[] */
+};
+struct pident_t *pidhash;   /* open-addressed pid -> job slot index */
+int pidcap;                 /* number of buckets, a power of 2 */
+int npids;                  /* number of pids in pidhash[] */
 
 int check_if_fg; /* to check if the process is in the foreground state. */
+int interrupted;  /* SIGINT arrived while there was no foreground job */
+int laststatus;   /* $?, the exit status of the last command */
+
+/* Builtin commands */
+#define BF_UTIL 1           /* also exists as a program in /bin or /usr/bin */
+
+typedef int builtin_fn_t(char **argv);
+struct builtin_t {          /* one builtin command */
+    char *name;             /* its name */
+    builtin_fn_t *fn;       /* runs it, returning its exit status */
+    int flags;              /* BF_ flags */
+};
+int preferbuiltins = 0;     /* if true, run /bin/echo etc. as builtins too */
+int inchild = 0;            /* true in a child forked to run a builtin */
+
+/* Child status records, queued by sigchld_handler for notify_drain */
+struct note_t {             /* one reaped or stopped child */
+    pid_t pid;              /* which child */
+    int status;             /* its wait status */
+    long long when;         /* CLOCK_MONOTONIC time it was reaped */
+    struct usage_t usage;   /* its resource usage, if it terminated */
+};
+struct note_t notes[NOTERING]; /* reaps waiting for notify_drain */
+unsigned notehead;          /* next record to consume */
+unsigned notetail;          /* next record to produce */
+int notefull;               /* sigchld_handler stopped because the ring filled */
+int usepidfd;               /* reap exits through pidfds, not waitpid(-1) */
+
+/* Event loop state */
+typedef void watcher_t(int fd, unsigned events, void *arg);
+typedef void timer_fn_t(void *arg);
+
+struct watch_t {            /* callback for a watched file descriptor */
+    watcher_t *fn;
+    void *arg;
+};
+struct evtimer_t {          /* one-shot event loop timer */
+    long long when;         /* CLOCK_MONOTONIC deadline in ns, 0 if free */
+    timer_fn_t *fn;
+    void *arg;
+};
+
+int epfd = -1;              /* epoll instance driving the event loop */
+int sigfd = -1;             /* signalfd for SIGCHLD, SIGINT and SIGTSTP */
+sigset_t origmask;          /* signal mask to restore in children */
+struct watch_t *watches;    /* watchers indexed by file descriptor */
+int nwatches;               /* allocated entries in watches[] */
+struct evtimer_t timers[MAXTIMERS]; /* pending timers */
+
+/* Launch engine state */
+struct redir_t {            /* one redirection, such as 2>>log */
+    int fd;                 /* descriptor it sets up */
+    char *op;               /* OP_IN, OP_OUT, OP_APPEND, OP_HERE, OP_DUPIN or OP_DUPOUT */
+    char *word;             /* file name, here-string or descriptor to copy */
+    int src;                /* what fd becomes, once redir_open has run */
+    int saved;              /* for a builtin: a copy of fd before, or -1 */
+};
+
+struct launch_t {           /* how to start one child process */
+    char **argv;            /* program and its arguments */
+    pid_t pgid;             /* process group to join, 0 to lead a new one */
+    int infd;               /* becomes the child's stdin, -1 to inherit */
+    int outfd;              /* becomes the child's stdout, -1 to inherit */
+    int errfd;              /* becomes the child's stderr, -1 to inherit */
+    int closefd;            /* closed in a forked child (the read end of its
+                               output pipe, which it mustn't keep open) */
+    struct redir_t *redirs; /* applied after infd and outfd, in order */
+    int nredirs;            /* number of redirs[] */
+    struct place_t *place;  /* CPUs it may run on, NULL for the shell's */
+    struct schedattr_t *sched; /* how it is scheduled, NULL like the shell */
+    struct cgroup_t *cg;    /* cgroup it joins, NULL for the shell's */
+    char **assigns;         /* NAME=value words in front of the command */
+    int nassigns;           /* number of assigns[] */
+    char **envp;            /* its environment, NULL for the shell's */
+};
+
+int usefork = 0;            /* if true, launch with fork+exec, not posix_spawn */
+int pipesize = 0;           /* F_SETPIPE_SZ for pipeline pipes, 0 for default */
+off_t prealloc = 0;         /* -A: bytes to reserve past the end of > and >> files */
+int stdin_redirected;       /* a builtin is running with its stdin redirected */
+struct launch_t *redirlp;   /* the builtin whose redirections are applied */
+posix_spawnattr_t spawnattr; /* attributes shared by every posix_spawn */
+long nlaunches;             /* children launched so far */
+long long launch_ns;        /* total time spent launching them */
+
+/* CPU placement */
+#define PL_NONE  0          /* -a: leave background jobs on the shell's CPUs */
+#define PL_RR    1          /* put each on the next CPU, alternating NUMA nodes */
+#define PL_LEAST 2          /* put each on the CPU with the fewest placed jobs */
+struct place_t {            /* where a job's processes may run */
+    int cpu;                /* the CPU -a picked, -1 for a --cpus list */
+    cpu_set_t set;          /* the CPUs */
+    char text[];            /* the list, as jobs shows it */
+};
+int placepolicy = PL_NONE;  /* -a */
+int placeready;             /* place_init has run */
+cpu_set_t shellcpus;        /* CPUs the shell was allowed to run on */
+int placeorder[CPU_SETSIZE]; /* those CPUs, taking each NUMA node in turn */
+int nplace;                 /* entries in placeorder[] */
+int placenext;              /* where the next round-robin pick starts */
+short nodeof[CPU_SETSIZE];  /* NUMA node of each CPU */
+int cpuload[CPU_SETSIZE];   /* live jobs placed on each CPU */
+int nodeload[CPU_SETSIZE];  /* and on each node */
+
+/* cgroup job containers */
+struct cglimit_t {          /* limits from --cpu-max and --mem-max, 0 for none */
+    long long cpu;          /* microseconds of CPU per CG_PERIOD */
+    long long mem;          /* bytes */
+};
+#define CG_PERIOD 100000    /* cpu.max period, in microseconds */
+struct cgroup_t {           /* a job's own cgroup */
+    int procsfd;            /* its cgroup.procs, for the children to join */
+    int frozen;             /* cgroup.freeze is 1 */
+    char path[];            /* its directory */
+};
+int cgjobs;                 /* -g: run every job in a cgroup of its own */
+int cgready;                /* cg_init has run */
+char *cgbase;               /* directory the job cgroups go in, NULL if none */
+pid_t cgowner;              /* the shell that made cgbase */
+long cgseq;                 /* names the next job cgroup */
+
+/* Command path cache */
+struct pathent_t {          /* one cached PATH search */
+    char *name;             /* command name */
+    char *path;             /* where it was found, NULL if it wasn't */
+    int hits;               /* number of times the entry was used */
+    int pinned;             /* set by "hash -p"; kept across invalidation */
+    struct pathent_t *next; /* next entry in the same bucket */
+};
+struct pathent_t *pathtab[PATHBUCKETS]; /* the cache, keyed by name */
+char *pathval;              /* the $PATH the cache was built against */
+unsigned pathseen;          /* pathgen when pathval was last checked */
+char **pathdirs;            /* pathval split into directories */
+int npathdirs;              /* number of entries in pathdirs[] */
+struct timespec *pathmtime; /* directory mtimes, if inotify is unavailable */
+int inotifyfd = -1;         /* inotify watching every PATH directory */
+
+/* Directory listings for pathname expansion */
+struct dirlist_t {          /* one directory's names, sorted */
+    char *path;             /* the directory, as the pattern named it */
+    dev_t dev;              /* its device */
+    ino_t ino;              /* and inode, in case it was replaced */
+    struct timespec mtime;  /* its mtime when it was read */
+    int trusted;            /* read long enough after mtime to be reused */
+    int n;                  /* number of names[] */
+    char **names;           /* into buf; each name's d_type is the byte before it */
+    char *buf;              /* the names */
+    struct dirlist_t *next; /* next most recently used */
+};
+struct dirlist_t *dirlists; /* most recently used first */
+int ndirlists;              /* entries in dirlists */
+char **globv;               /* words a pattern expanded to */
+size_t nglobv, globcap;     /* entries in globv and its size */
+
+/* Shell variables */
+struct var_t {              /* one variable */
+    char *entry;            /* "NAME=value", as the environment has it */
+    size_t namelen;         /* length of NAME */
+    int envi;               /* its slot in envv[], -1 if it isn't exported */
+    struct var_t *next;     /* next variable in the same bucket */
+};
+struct var_t *vartab[VARBUCKETS]; /* every variable, keyed by name */
+char **envv;                /* the exported entries; environ points here */
+int nenv, envcap;           /* entries in envv and its size */
+unsigned pathgen;           /* changes whenever PATH is set or unset */
+
+/* Compiled scripts */
+#define PROGMAGIC   0x43485354 /* "TSHC" */
+#define PROGVERSION 4
+#define PW_OP 0x80000000u   /* pword_t.str is PW_OP | an index into progops[] */
+struct proghdr_t {          /* start of a compiled script */
+    uint32_t magic;         /* PROGMAGIC */
+    uint32_t version;       /* PROGVERSION */
+    uint64_t hash;          /* script_hash of the script's text */
+    uint32_t size;          /* bytes in the program, this header included */
+    uint32_t nlines;        /* pline_t entries that follow the header */
+};
+struct pline_t {            /* one command line of a compiled script */
+    uint32_t text;          /* its text, with the newline */
+    int32_t bg;             /* what parseline returned, -2 if it is too long */
+    uint32_t nwords;        /* words on the line */
+    uint32_t words;         /* its nwords + 1 pword_t, the last for the end */
+};
+struct pword_t {            /* one word of a line */
+    uint32_t str;           /* the word, or PW_OP | index */
+    uint32_t src;           /* where it starts in the line's text */
+};
+/* offsets in pline_t and pword_t are from the end of the pline_t array */
+char *scriptcache;          /* -C: directory of compiled scripts */
+int execlast;               /* -c: exec the last command instead of forking it */
+
+/* Latency statistics */
+enum { PH_PARSE, PH_LOOKUP, PH_SPAWN, PH_BUILTIN, PH_REAP, PH_NOTIFY,
+       PH_WAKEUP, NPHASES };
+struct hist_t {             /* log-bucketed latency histogram */
+    long count;             /* samples recorded */
+    long long sum;          /* their total, in ns */
+    long long max;          /* the largest, in ns */
+    long buckets[HISTBUCKETS];
+};
+struct hist_t hists[NPHASES]; /* one histogram per phase */
+char *statsfile;            /* -S: append the statistics here at exit */
+long nreaps;                /* children reaped */
+long nsignals;              /* signals forwarded to jobs */
+long nnotes;                /* stop and exit records applied to jobs */
+long long fgchanged;        /* when the foreground job last stopped or ended */
+
+/* Buffered command input, filled by the event loop */
+char *inbuf;                /* bytes read from stdin but not yet consumed */
+size_t inpos, inlen, incap; /* consumed offset, valid bytes, capacity */
+int stdin_pollable = 1;     /* false if stdin can't be watched by epoll */
+int input_ready;            /* set by the stdin watcher */
+int input_eof;              /* stdin has reached end of file */
+size_t maxline;             /* longest command line accepted (ARG_MAX) */
+char *linebuf;              /* the line getcmdline last returned */
+size_t linecap;             /* bytes allocated for linebuf */
+
+/* Command arena: the words of the command line being run */
+struct ablock_t {           /* one block of the arena */
+    struct ablock_t *next;  /* the block allocated before this one */
+    size_t size;            /* bytes in data[] */
+    size_t used;            /* bytes of data[] handed out */
+    char data[];
+};
+struct ablock_t *arena;     /* newest block, NULL until first used */
+char **lexargs;             /* parseline's scratch list of words */
+const char **lexsrc;        /* and where each of them starts in the line */
+size_t lexcap;              /* entries in lexargs[] */
+int parsequiet;             /* parseline keeps its errors to itself */
+char OP_PIPE[] = "|";       /* parseline's word for an unquoted | */
+char OP_BG[] = "&";         /* parseline's word for an unquoted & */
+char OP_CAPTURE[] = "&!";   /* and for &!, which runs a job with its output captured */
+char OP_SEQ[] = ";";        /* and for the operators that join the commands of a list */
+char OP_AND[] = "&&";
+char OP_OR[] = "||";
+char OP_IN[] = "<";         /* and for the redirection operators */
+char OP_OUT[] = ">";
+char OP_APPEND[] = ">>";
+char OP_HERE[] = "<<<";
+char OP_DUPIN[] = "<&";
+char OP_DUPOUT[] = ">&";
+char fdwords[10][2] = { "0", "1", "2", "3", "4", "5", "6", "7", "8", "9" };
+                            /* a digit right before < or >, as in 2>&1 */
 /* End global variables */
 
 
@@ -59,28 +442,172 @@ int check_if_fg; /* to check if the process is in the foreground state. */
 
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
+void evallist(char *cmdline, char **argv, const char **src, int is_bg, long long t0);
+void evalcmd(char **argv, int is_bg, char *cmdline, long long t0);
 int builtin_cmd(char **argv);
-void do_bgfg(char **argv);
+int do_bgfg(char **argv);
 void waitfg(pid_t pid);
 
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
+void notify_drain(void);
+void pidfd_ready(int fd, unsigned events, void *arg);
+
+/* Event loop routines */
+void loop_init(void);
+int loop_watch(int fd, unsigned events, watcher_t *fn, void *arg);
+int loop_modify(int fd, unsigned events);
+void loop_unwatch(int fd);
+int loop_timer(int ms, timer_fn_t *fn, void *arg);
+void loop_cancel(int id);
+void loop_once(int block);
+void signal_ready(int fd, unsigned events, void *arg);
+void stdin_ready(int fd, unsigned events, void *arg);
+char *getcmdline(void);
+long long now_ns(void);
+
+/* Launch routines */
+void launch_init(void);
+pid_t launch(struct launch_t *lp);
+int launch_pipeline(struct launch_t *stages, int nstages, pid_t *pids, int capfd,
+		    struct place_t *place, struct schedattr_t *sched,
+		    struct cgroup_t *cg);
+int redir_open(struct launch_t *lp);
+void redir_close(struct launch_t *lp);
+int redir_push(struct launch_t *lp);
+void redir_pop(struct launch_t *lp);
+void redir_swap(struct launch_t *lp, int undo);
+void launch_exec(struct launch_t *lp);
+void launch_report(void);
+
+/* Output capture routines */
+struct ring_t *ring_new(void);
+void ring_start(struct ring_t *r);
+void ring_ready(int fd, unsigned events, void *arg);
+void ring_free(struct ring_t *r);
+void copyout(int fd, off_t off, off_t end);
+void ring_print(struct ring_t *r);
+int do_joblog(char **argv);
+
+/* CPU placement routines */
+void place_init(void);
+int place_prefix(char ***argvp, struct place_t **pp);
+struct place_t *place_auto(void);
+void place_apply(struct job_t *job);
+void place_free(struct place_t *p);
+
+/* Scheduling class routines */
+int job_prefix(char ***argvp, struct place_t **pp, struct schedattr_t *sa,
+	       struct cglimit_t *lim);
+int sched_set(pid_t tid, struct schedattr_t *sa);
+void sched_apply(struct job_t *job, struct schedattr_t *sa);
+void sched_bgfg(struct job_t *job, int bg);
+int do_prio(char **argv);
+
+/* cgroup routines */
+void cg_init(void);
+int cg_opt(char ***argvp, struct cglimit_t *lim);
+struct cgroup_t *cg_new(struct cglimit_t *lim);
+int cg_join(struct cgroup_t *cg, pid_t pid);
+int cg_freeze(struct job_t *job, int frozen);
+int cg_signal(struct cgroup_t *cg, int sig);
+void cg_account(struct job_t *job);
+void cg_free(struct cgroup_t *cg);
+void cg_cleanup(void);
+
+/* Script routines */
+struct proghdr_t *script_compile(const char *text, size_t len, uint64_t hash);
+struct proghdr_t *script_load(uint64_t hash);
+void script_save(struct proghdr_t *prog);
+void script_run(struct proghdr_t *prog);
+void runscript(char *path);
+void runcommand(char *command);
+
+/* Pathname expansion routines */
+int glob(char *pattern);
+void glob_push(char *word);
+char *glob_unmark(char *word);
+struct dirlist_t *dirlist_get(const char *path);
+
+/* Shell variable routines */
+void var_init(void);
+int var_namelen(const char *s);
+struct var_t *var_find(const char *name, size_t len);
+char *var_get(const char *name);
+void var_set(const char *name, size_t len, const char *value, int export);
+void var_unset(const char *name, size_t len);
+char **var_env(char **base, char **assigns, int n);
+int do_export(char **argv);
+int do_unset(char **argv);
+
+/* Command path cache routines */
+struct pathent_t *path_lookup(char *name);
+void path_forget(char *name);
+void path_flush(int all);
+void path_ready(int fd, unsigned events, void *arg);
+int do_hash(char **argv);
+
+/* Builtin command routines */
+void builtin_init(void);
+struct builtin_t *getbuiltin(char *name);
+int do_quit(char **argv);
+int do_jobs(char **argv);
+int do_echo(char **argv);
+int do_cd(char **argv);
+int do_pwd(char **argv);
+int do_kill(char **argv);
+int do_wait(char **argv);
+int do_true(char **argv);
+int do_false(char **argv);
+int do_sleep(char **argv);
+int do_stats(char **argv);
+int do_parallel(char **argv);
 
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
+int parseline(const char *cmdline, char ***argvp, const char ***srcp); 
+int islistop(char *word);
+char **expand(char **argv);
+struct launch_t *parsepipe(char **argv, int *np);
+void *arena_alloc(size_t n);
+void arena_reset(void);
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
+struct jobinfo_t *getjobinfo(struct job_t *job);
+struct cmdstr_t *cmdstr_new(const char *text);
+void cmdstr_put(struct cmdstr_t *c);
+void initjobs(void);
 int maxjid(struct job_t *jobs); 
 int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
+int addproc(struct job_t *jobs, struct job_t *job, pid_t pid);
 int deletejob(struct job_t *jobs, pid_t pid); 
 pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
 struct job_t *getjobjid(struct job_t *jobs, int jid); 
 int pid2jid(pid_t pid); 
 void listjobs(struct job_t *jobs);
+void setjobstate(struct job_t *jobs, struct job_t *job, int state);
+int signaljob(struct job_t *job, int sig);
+void getusage(struct usage_t *u, struct rusage *ru);
+void addusage(struct usage_t *sum, struct usage_t *u);
+void recordjob(struct job_t *job, int status, long long end);
+struct donejob_t *getdonepid(pid_t pid);
+void listjobs_usage(struct job_t *jobs);
+void printtimes(long long wall, struct usage_t *u);
+
+/* Here are the job scheduler routines */
+int sched_full(void);
+void queue_save(struct job_t *job, char **prefix, int nprefix,
+		struct launch_t *stages, int nstages, int bg);
+void queue_free(struct queued_t *q);
+int startjob(struct job_t *job, int state);
+void sched_run(void);
+
+/* Here are the statistics routines */
+void stat_record(int phase, long long ns);
+void stats_print(FILE *fp, int raw);
+void stats_dump(void);
 
 void usage(void);
 void unix_error(char *msg);
@@ -94,7 +621,8 @@ handler_t *Signal(int signum, handler_t *handler);
 int main(int argc, char **argv) 
 {
     char c;
-    char cmdline[MAXLINE];
+    char *cmdline;
+    char *command = NULL; /* -c: the commands to run instead of stdin */
     int emit_prompt = 1; /* emit prompt (default) */
 
     /* Redirect stderr to stdout (so that driver will get all output
@@ -102,7 +630,7 @@ int main(int argc, char **argv)
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvpfbdgP:S:j:A:R:C:c:a:")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -113,6 +641,48 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
 	    break;
+        case 'f':             /* launch children with fork+exec */
+            usefork = 1;
+	    break;
+        case 'b':             /* run /bin/echo etc. as builtins */
+            preferbuiltins = 1;
+	    break;
+        case 'P':             /* pipe buffer size for pipelines */
+            pipesize = atoi(optarg);
+	    break;
+        case 'S':             /* dump latency statistics at exit */
+            statsfile = optarg;
+	    break;
+        case 'j':             /* most jobs to run at once */
+            maxrunning = atoi(optarg);
+	    break;
+        case 'A':             /* preallocate output files */
+            prealloc = atoll(optarg);
+	    break;
+        case 'R':             /* output kept for each &! job */
+            if ((ringsize = atol(optarg)) == 0)
+		usage();
+	    break;
+        case 'C':             /* cache compiled scripts */
+            scriptcache = optarg;
+	    break;
+        case 'c':             /* run a command and exit */
+            command = optarg;
+	    break;
+        case 'g':             /* run each job in its own cgroup */
+            cgjobs = 1;
+	    break;
+        case 'd':             /* demote jobs bg sends to the background */
+            demote = 1;
+	    break;
+        case 'a':             /* place background jobs on CPUs */
+            if (!strcmp(optarg, "rr"))
+		placepolicy = PL_RR;
+	    else if (!strcmp(optarg, "least"))
+		placepolicy = PL_LEAST;
+	    else if (strcmp(optarg, "none"))
+		usage();
+	    break;
 	default:
             usage();
 	}
@@ -120,16 +690,30 @@ int main(int argc, char **argv)
 
     /* Install the signal handlers */
 
-    /* These are the ones you will need to implement */
-    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
-    Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+    /* SIGINT (ctrl-c), SIGTSTP (ctrl-z) and SIGCHLD (terminated or
+     * stopped child) are delivered through the event loop's signalfd,
+     * so their handlers run synchronously from the main loop */
+    loop_init();
+    launch_init();
+    builtin_init();
+    var_init();
+    if (statsfile)
+	atexit(stats_dump);
+    if ((long)(maxline = sysconf(_SC_ARG_MAX)) <= 0)
+	maxline = 128 * 1024;
 
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler); 
 
     /* Initialize the job list */
-    initjobs(jobs);
+    initjobs();
+
+    /* A -c command or a script named on the command line runs
+     * instead of stdin */
+    if (command)
+	runcommand(command);
+    if (optind < argc)
+	runscript(argv[optind]);
 
     /* Execute the shell's read/eval loop */
     while (1) {
@@ -139,87 +723,451 @@ int main(int argc, char **argv)
 	    printf("%s", prompt);
 	    fflush(stdout);
 	}
-	if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-	    app_error("fgets error");
-	if (feof(stdin)) { /* End of file (ctrl-d) */
+	if ((cmdline = getcmdline()) == NULL) { /* End of file (ctrl-d) */
 	    fflush(stdout);
 	    exit(0);
 	}
 
-	/* Evaluate the command line */
+	/* Evaluate the command line, then free its words */
 	eval(cmdline);
+	arena_reset();
 	fflush(stdout);
 	fflush(stdout);
     } 
 
     exit(0); /* control never reaches here */
 }
+
+/*
+ * redir_open - Open the files named by lp's redirections, in the shell,
+ *    so that a missing file is reported before anything is launched.
+ *    Each redirection's src becomes the descriptor that the child (or
+ *    a builtin) gets as its fd. Returns 0, or -1 after printing a
+ *    message.
+ *
+ * A here-string is written to a memfd, so it needs neither a temporary
+ * file nor a process to feed it. With -A, files opened by > and >>
+ * get that many bytes reserved past their end, so a job writing a long
+ * log doesn't allocate its blocks one write at a time.
+ */
+int redir_open(struct launch_t *lp)
+{
+    struct redir_t *r;
+    int i, fd, flags;
+
+    for (i = 0; i < lp->nredirs; i++)
+	lp->redirs[i].src = -1;
+    for (i = 0; i < lp->nredirs; i++) {
+	r = &lp->redirs[i];
+	if (r->op == OP_DUPIN || r->op == OP_DUPOUT) {
+	    r->src = r->word[0] - '0';
+	    continue;
+	}
+	if (r->op == OP_HERE) {
+	    struct iovec iov[2] = { { r->word, strlen(r->word) }, { "\n", 1 } };
+
+	    if ((r->src = memfd_create("herestring", MFD_CLOEXEC)) < 0)
+		unix_error("memfd_create error");
+	    if (writev(r->src, iov, 2) < 0 || lseek(r->src, 0, SEEK_SET) < 0)
+		unix_error("here-string error");
+	}
+	else {
+	    flags = r->op == OP_IN ? O_RDONLY :
+		r->op == OP_APPEND ? O_WRONLY | O_CREAT | O_APPEND :
+		O_WRONLY | O_CREAT | O_TRUNC;
+	    if ((r->src = open(r->word, flags | O_CLOEXEC, 0666)) < 0) {
+		printf("%s: %s\n", r->word, strerror(errno));
+		redir_close(lp);
+		return -1;
+	    }
+	    if (prealloc > 0 && r->op != OP_IN)
+		fallocate(r->src, FALLOC_FL_KEEP_SIZE,
+			  r->op == OP_APPEND ? lseek(r->src, 0, SEEK_END) : 0,
+			  prealloc);
+	}
+	if (r->src == r->fd) {	/* dup2 onto itself keeps O_CLOEXEC */
+	    fd = fcntl(r->src, F_DUPFD_CLOEXEC, 10);
+	    close(r->src);
+	    r->src = fd;
+	}
+    }
+    return 0;
+}
+
+/* redir_close - Close the descriptors that redir_open opened */
+void redir_close(struct launch_t *lp)
+{
+    struct redir_t *r;
+    int i;
+
+    for (i = 0; i < lp->nredirs; i++) {
+	r = &lp->redirs[i];
+	if (r->src >= 0 && r->op != OP_DUPIN && r->op != OP_DUPOUT)
+	    close(r->src);
+	r->src = -1;
+    }
+}
+
+/*
+ * redir_push - Apply lp's redirections to the shell itself, for a
+ *    builtin, saving what they replace. Returns 0, or -1 after printing
+ *    a message if a file can't be opened.
+ */
+int redir_push(struct launch_t *lp)
+{
+    struct redir_t *r;
+    int i;
+
+    if (lp->nredirs == 0)
+	return 0;
+    if (redir_open(lp) < 0)
+	return -1;
+    fflush(stdout);
+    for (i = 0; i < lp->nredirs; i++) {
+	r = &lp->redirs[i];
+	r->saved = fcntl(r->fd, F_DUPFD_CLOEXEC, 10); /* -1 if it was closed */
+	dup2(r->src, r->fd);
+	if (r->fd == STDIN_FILENO)
+	    stdin_redirected = 1;
+    }
+    redirlp = lp;
+    return 0;
+}
+
+/* redir_pop - Undo redir_push, once the builtin is done */
+void redir_pop(struct launch_t *lp)
+{
+    struct redir_t *r;
+    int i;
+
+    if (lp->nredirs == 0)
+	return;
+    fflush(stdout);
+    for (i = lp->nredirs-1; i >= 0; i--) {
+	r = &lp->redirs[i];
+	if (r->saved >= 0) {
+	    dup2(r->saved, r->fd);
+	    close(r->saved);
+	}
+	else
+	    close(r->fd);
+    }
+    stdin_redirected = 0;
+    redirlp = NULL;
+    redir_close(lp);
+}
+
+/*
+ * redir_swap - Swap the shell's fds under redir_push with the ones it
+ *    saved, so a job started meanwhile gets the shell's own. undo is 0
+ *    to take them out, last first, and 1 to put them back again.
+ */
+void redir_swap(struct launch_t *lp, int undo)
+{
+    struct redir_t *r;
+    int i, tmp;
+
+    fflush(stdout);
+    for (i = 0; i < lp->nredirs; i++) {
+	r = &lp->redirs[undo ? i : lp->nredirs-1 - i];
+	tmp = fcntl(r->fd, F_DUPFD_CLOEXEC, 10); /* -1 if it was closed */
+	if (r->saved >= 0) {
+	    dup2(r->saved, r->fd);
+	    close(r->saved);
+	}
+	else
+	    close(r->fd);
+	r->saved = tmp;
+    }
+}
   
 /* 
  * eval - Evaluate the command line that the user has just typed in
  * 
- * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
- * the foreground, wait for it to terminate and then return.  Note:
- * each child process must have a unique process group ID so that our
- * background children don't receive SIGINT (SIGTSTP) from the kernel
- * when we type ctrl-c (ctrl-z) at the keyboard.  
+ * The line may be a list of commands joined by ;, &, &!, && and ||.
+ * It is parsed once, and evalcmd runs each command in turn: && runs
+ * the next one only if the last one succeeded, || only if it failed.
 */
 void eval(char *cmdline) 
 {
 	
-	sigset_t set;
 	if(strcmp(cmdline,"\n")==0)	/* entering blank lines would return prompt again */
 		return;
-	char* argv[MAXARGS];
-	int is_bg = parseline(cmdline,argv);
-	int builtin=builtin_cmd(argv);
+	char** argv;	/* the words of the line, in the command arena */
+	const char** src;	/* where each word starts in cmdline */
+	long long t0 = now_ns();	/* for the parse and builtin statistics */
+	int is_bg = parseline(cmdline,&argv,&src);
+	if(is_bg < 0)	/* parseline reported the error */
+	{
+		laststatus = 2;
+		return;
+	}
+	evallist(cmdline,argv,src,is_bg,t0);
+}
+
+/*
+ * evallist - Run the commands of a line that parseline has split into
+ * argv, with src[i] the start of argv[i] in cmdline. A compiled script
+ * comes straight here, without parseline.
+*/
+void evallist(char *cmdline, char **argv, const char **src, int is_bg, long long t0)
+{
+	/*
+	A line without list operators is one command, and it keeps the whole line as the text of its job.
+	*/
+	int i, list = 0;
+	for(i=0; argv[i]!=NULL; i++)
+		list |= islistop(argv[i]);
+	if(!list)
+	{
+		if(argv[0] != NULL)	/* not a line of spaces */
+			evalcmd(argv,is_bg,cmdline,t0);
+		return;
+	}
+
+	/*
+	Otherwise each command is cut off at the operator after it. Its job gets the text from its first word up to the operator, including a & or &!.
+	*/
+	char **cmd = argv;	/* first word of the next command */
+	char *join = OP_SEQ;	/* the operator in front of it */
+	int exec = execlast;	/* only the last command can be exec'd */
+	execlast = 0;
+	for(i=0; ; i++)
+	{
+		char *op = argv[i];
+		if(op != NULL && !islistop(op))
+			continue;
+		argv[i] = NULL;
+		if(cmd[0] == NULL)	/* after a trailing ; */
+			break;
+		int bg = op == OP_BG ? 1 : op == OP_CAPTURE ? 2 : op == NULL ? is_bg : 0;
+		const char *end = src[i] + bg;	/* just past the & or &! */
+		const char *from = src[cmd-argv];
+		while(end > from && isspace((unsigned char)end[-1]))
+			end--;
+		if(join == OP_AND ? laststatus == 0 : join == OP_OR ? laststatus != 0 : 1)
+		{
+			char *text = arena_alloc(end-from+2);
+			memcpy(text,from,end-from);
+			strcpy(text+(end-from),"\n");
+			execlast = exec && op == NULL;
+			evalcmd(cmd,bg,text,t0);
+			fflush(stdout);	/* before the next command's children write */
+			t0 = now_ns();
+		}
+		if(op == NULL)
+			break;
+		join = op;
+		cmd = &argv[i+1];
+	}
+}
+
+/*
+ * evalcmd - Run one command of the line: a builtin runs in the shell
+ * itself; otherwise fork a child process for each stage and run the
+ * job in the context of the children. If the job is running in the
+ * foreground, wait for it to terminate and then return.  Note: each
+ * job must have a unique process group ID so that our background
+ * children don't receive SIGINT (SIGTSTP) from the kernel when we type
+ * ctrl-c (ctrl-z) at the keyboard.  $? is set to its exit status.
+*/
+void evalcmd(char **argv, int is_bg, char *cmdline, long long t0)
+{
+	struct launch_t* stages;	/* argv and redirections of each stage of a pipeline */
+	pid_t* pids;	/* pid of each stage, 0 if it didn't start */
+	int nstages;
+	argv = expand(argv);	/* $? is the status of the command before this one; globs match files */
+	if(argv[0] == NULL)	/* only variables that are empty */
+	{
+		laststatus = 0;
+		return;
+	}
+
+	/*
+	A "time" prefix reports the real, user and system time of a foreground command once it is done.
+	*/
+	char **args = argv;
+	int timed = !is_bg && strcmp(argv[0],"time")==0;
+	long long start = now_ns();
+	struct rusage self0, self1;
+	if(timed)
+	{
+		args++;
+		getrusage(RUSAGE_SELF,&self0);
+		if(args[0] == NULL)	/* nothing to time */
+		{
+			struct usage_t none = { 0 };
+			printtimes(0,&none);
+			laststatus = 0;
+			return;
+		}
+	}
+
+	/*
+	A "--cpus LIST" prefix places the job's processes on those CPUs. Without one, the -a policy may place a background job.
+	"--nice N", "--sched POLICY" and "--io CLASS" prefixes set how they are scheduled, and "--cpu-max" and "--mem-max" limit them through the job's cgroup.
+	*/
+	struct place_t *place;
+	struct schedattr_t sa;
+	struct cglimit_t lim;
+	if(job_prefix(&args,&place,&sa,&lim) < 0)
+	{
+		laststatus = 2;
+		return;
+	}
+	stages = parsepipe(args,&nstages);
+	long long t1 = now_ns();
+	stat_record(PH_PARSE,t1-t0);
+	if(stages == NULL)	/* parsepipe reported the error */
+	{
+		place_free(place);
+		laststatus = 2;
+		return;
+	}
+	args = stages[0].argv;
+
+	/*
+	A command of nothing but NAME=value words sets shell variables. In front of a command, they are only in its environment.
+	*/
+	if(args[0] == NULL)
+	{
+		place_free(place);
+		for(int i=0; i<stages[0].nassigns; i++)
+		{
+			char *word = stages[0].assigns[i];
+			var_set(word,strchr(word,'=')-word,strchr(word,'=')+1,0);
+		}
+		laststatus = 0;
+		return;
+	}
+
+	/*
+	A builtin runs in the shell itself, so its redirections are applied to the shell's own descriptors and undone when it returns.
+	*/
+	int builtin = nstages==1 && getbuiltin(args[0]) != NULL;
+	if(builtin)
+	{
+		place_free(place);	/* it runs on the shell's CPUs */
+		place = NULL;
+		if(redir_push(&stages[0]) == 0)
+		{
+			builtin_cmd(args);	/* sets $? */
+			redir_pop(&stages[0]);
+		}
+		else
+			laststatus = 1;
+		stat_record(PH_BUILTIN,now_ns()-t1);
+	}
+	if(builtin && timed)	/* the builtin ran in the shell itself */
+	{
+		struct usage_t u0, u1;
+		getrusage(RUSAGE_SELF,&self1);
+		getusage(&u0,&self0);
+		getusage(&u1,&self1);
+		u1.utime -= u0.utime;
+		u1.stime -= u0.stime;
+		printtimes(now_ns()-start,&u1);
+	}
+	/*
+	With -c, the last command takes over the shell's process when nothing would be left to do but wait for it, and it needs no cgroup of its own.
+	*/
+	if(!builtin && execlast && !is_bg && !timed && nstages==1 && stages[0].nredirs==0 && !cgjobs && lim.cpu==0 && lim.mem==0)
+	{
+		stages[0].place = place;
+		stages[0].sched = sa.flags ? &sa : NULL;
+		launch_exec(&stages[0]);	/* doesn't return */
+	}
+	if(!builtin && is_bg && sched_full())	/* no free run slot: queue the job */
+	{
+		place_free(place);	/* startjob places it when it starts */
+		if(addjob(jobs,0,QU,cmdline))
+		{
+			/* it runs what the line means now, not when it starts */
+			queue_save(getjobjid(jobs,maxjid(jobs)),argv,stages[0].argv-argv,stages,nstages,is_bg);
+			printf("[%d] (0) Queued %s",maxjid(jobs),cmdline);
+		}
+		laststatus = 0;
+		return;
+	}
 	if(!builtin)	/* for a non-builtin command */
 	{
-		sigemptyset(&set);
-		sigaddset(&set,SIGCHLD);	
-		if(sigprocmask(SIG_BLOCK,&set,NULL) < 0)	/* error handling */
-			unix_error("sigprocmask error\n");		
-		pid_t pid;
-		if((pid=fork())==0)
+		/*
+		SIGCHLD stays blocked in the shell and is only consumed by the event loop, so the children cannot be reaped before they are added to the job list.
+		All stages of a pipeline run in the process group of the first stage and share one job.
+		*/
+		/*
+		With &!, the job's stdout and stderr go to a pipe that the event loop drains into a ring for joblog.
+		*/
+		/*
+		With -g or a limit, the job gets a cgroup of its own, which everything it starts stays in.
+		*/
+		struct ring_t *ring = is_bg == 2 ? ring_new() : NULL;
+		struct cgroup_t *cg = cg_new(&lim);
+		if(place == NULL && is_bg)
+			place = place_auto();
+		pids = arena_alloc(nstages*sizeof(*pids));
+		if(launch_pipeline(stages,nstages,pids,ring ? ring->wfd : -1,place,sa.flags ? &sa : NULL,cg) == 0)	/* no stage could be started */
 		{
-			setpgid(0, 0);
-			
-			/* unblocking SIGCHLD signal */
-			if(sigprocmask(SIG_UNBLOCK,&set,NULL) < 0)	/* error handling */
-				unix_error("sigprocmask error\n");			
-			
-			execvp(argv[0],argv);
-			printf("%s : Command not found\n",argv[0]);	/* if execvp fails, print error message and terminate the child process */
-			exit(0);
+			ring_free(ring);
+			place_free(place);
+			cg_free(cg);
+			laststatus = 127;
+			return;
+		}
+		if(ring)
+			ring_start(ring);
+		pid_t pid = 0;
+		struct job_t *job = NULL;
+		for(int i=0; i<nstages; i++)
+		{
+			if(pids[i] == 0)
+				continue;
+			if(pid == 0)	/* the first stage that started leads the job */
+			{
+				pid = pids[i];
+				if(!addjob(jobs,pid,is_bg ? BG : FG,cmdline)) /* add job to the joblist */
+				{
+					/* don't leave children running that no job tracks; with pidfds nothing else would reap them */
+					for(; i<nstages; i++)
+						if(pids[i])
+						{
+							kill(pids[i],SIGKILL);
+							waitpid(pids[i],NULL,0);
+						}
+					ring_free(ring);
+					place_free(place);
+					cg_free(cg);
+					laststatus = 1;
+					return;
+				}
+				job = getjobpid(jobs,pid);
+				getjobinfo(job)->ring = ring;
+				getjobinfo(job)->place = place;
+				getjobinfo(job)->sched = sa;
+				getjobinfo(job)->cg = cg;
+			}
+			else
+				addproc(jobs,job,pids[i]);
 		}
-		//waitfg(pid);
 		if(!is_bg) 
 		{ 
 		
 	/* 
-	If the job is a foreground job, then add it to the joblist with state 'FG' and unblock the SIGCHLD signal.	
+	If the job is a foreground job, wait for it.
 	*/
-				addjob(jobs,pid,FG,cmdline); /* add job to the joblist */
-				
-				/* unblocking SIGCHLD signal */
-				if(sigprocmask(SIG_UNBLOCK,&set,NULL) < 0)	/* error checking */
-					unix_error("sigprocmask error\n");
-				waitfg(pid); /* ensuring only 1 foreground process is there */
+				waitfg(pid); /* ensuring only 1 foreground process is there; notify_drain sets $? */
+				struct donejob_t *d;
+				if(timed && (d = getdonepid(pid)) != NULL)	/* not if it was stopped */
+					printtimes(d->end - d->start,&d->usage);
 		} 
 		else 
 		{
 		
 	/* 
-	If the job is a background job, then add it to the joblist with state 'BG' and unblock the SIGCHLD signal. 
+	If the job is a background job, report it and carry on. 
 	*/
-			addjob(jobs,pid,BG,cmdline); /* add job to the joblist */
 			printf("[%d] (%d) %s", pid2jid(pid),pid,cmdline); 
-			
-			/* unblocking SIGCHLD signal */
-			if(sigprocmask(SIG_UNBLOCK,&set,NULL) < 0)	/* error checking */
-				unix_error("sigprocmask error\n");
+			laststatus = 0;
 	/* 
 	There can be multible jobs running in the background. Hence, we do not have to wait for the job to terminate before adding another background job. 
 	*/
@@ -229,106 +1177,503 @@ void eval(char *cmdline)
 			
 }
 
+/* islistop - True if word separates the commands of a list */
+int islistop(char *word)
+{
+    return word == OP_SEQ || word == OP_AND || word == OP_OR ||
+	word == OP_BG || word == OP_CAPTURE;
+}
+
+/*
+ * varref - Return the length of the ? or variable name after a $ at s,
+ *    which may be in braces, and set *skip to the characters it takes
+ *    up with them. Returns 0 if there isn't one, and the $ is a plain
+ *    character.
+ */
+static int varref(const char *s, int *skip)
+{
+    int n, brace = *s == '{';
+
+    n = s[brace] == '?' ? 1 : var_namelen(s + brace);
+    if (n == 0 || (brace && s[1+n] != '}'))
+	return 0;
+    *skip = n + 2 * brace;
+    return n;
+}
+
 /* 
  * parseline - Parse the command line and build the argv array.
  * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
+ * The line is split into words in one pass, like sh does it: text in
+ * single quotes is taken literally, text in double quotes is too
+ * except that \" \\ \$ and \` stand for the second character, and
+ * outside quotes a backslash takes away the meaning of a following
+ * space, quote or other special character (it is kept before anything
+ * else, so "\046" still reaches /bin/echo -e). An unquoted |, &, &!,
+ * ;, && or || is a word of its own, given as an OP_ string, so a quoted
+ * "|" is never mistaken for one. So is a redirection operator (<, >,
+ * >>, <<<, <& or >&, given as an OP_ string) that starts a word, with
+ * a digit just in front of it given as an fdwords[] string. Unlike sh,
+ * < and > inside a word are plain characters, so "echo tsh> foo" in the
+ * traces still prints its prompt instead of writing a file. A # that
+ * starts a word starts a comment, which ends the line. A $?, $NAME or
+ * ${NAME} outside single quotes becomes SUBST (QSUBST inside double
+ * quotes), the ? or NAME and another SUBST, for expand to fill in when
+ * the command runs, which may be after others on the line.
+ * For the same reason, an unquoted *, ? or [ becomes GLOBSTAR, GLOBONE
+ * or GLOBSET, for expand to match against file names. An unquoted =
+ * right after a NAME typed literally becomes ASSIGN: only such a word
+ * can be a NAME=value in front of a command, whatever expand makes of
+ * the others.
+ *
+ * The words and *argvp are allocated in the command arena, and so is
+ * *srcp, if srcp isn't NULL: where each word starts in cmdline, and
+ * where the line ends. Return true if the user has requested that the
+ * last command run as a BG job (2 if it ends in &!, to capture its
+ * output), false if it is a FG job, or -1 after printing a message if
+ * the line can't be parsed.
  */
-int parseline(const char *cmdline, char **argv) 
+int parseline(const char *cmdline, char ***argvp, const char ***srcp) 
 {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
-    int argc;                   /* number of args */
-    int bg;                     /* background job? */
+    static const char special[] = " \t\n\\'\"|&;<>()$`*?[#~";
+    const char *p = cmdline;
+    char *buf, *word, **argv;
+    size_t argc = 0, i, len;
+    int quote, bg, n, skip, lit;
 
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-	buf++;
+    /* words never outgrow the line, but for a SUBST more for each $ */
+    for (len = 0, i = 0; p[i]; i++)
+	len += p[i] == '$';
+    buf = arena_alloc(i + len + 1);
+    while (1) {
+	while (*p == ' ' || *p == '\t' || *p == '\n') /* ignore spaces */
+	    p++;
+	if (*p == '\0' || *p == '#')	/* a comment runs to the end */
+	    break;
+	if (argc + 1 >= lexcap) {
+	    lexcap = lexcap ? 2 * lexcap : 64;
+	    if ((lexargs = realloc(lexargs, lexcap * sizeof(*lexargs))) == NULL ||
+		(lexsrc = realloc(lexsrc, lexcap * sizeof(*lexsrc))) == NULL)
+		unix_error("realloc error");
+	}
+	lexsrc[argc] = p;
+	if (*p == '&' && (p[1] == '!' || p[1] == '&')) {
+	    lexargs[argc++] = p[1] == '!' ? OP_CAPTURE : OP_AND, p += 2;
+	    continue;
+	}
+	if (*p == '|' && p[1] == '|') {
+	    lexargs[argc++] = OP_OR, p += 2;
+	    continue;
+	}
+	if (*p == ';') {
+	    lexargs[argc++] = OP_SEQ, p++;
+	    continue;
+	}
+	if (*p == '|' || *p == '&') {
+	    lexargs[argc++] = *p++ == '|' ? OP_PIPE : OP_BG;
+	    continue;
+	}
+	if (isdigit((unsigned char)*p) && (p[1] == '<' || p[1] == '>')) {
+	    lexargs[argc++] = fdwords[*p++ - '0'];
+	    continue;
+	}
+	if (*p == '<') {
+	    if (p[1] == '<' && p[2] == '<')
+		lexargs[argc++] = OP_HERE, p += 3;
+	    else if (p[1] == '&')
+		lexargs[argc++] = OP_DUPIN, p += 2;
+	    else
+		lexargs[argc++] = OP_IN, p++;
+	    continue;
+	}
+	if (*p == '>') {
+	    if (p[1] == '>')
+		lexargs[argc++] = OP_APPEND, p += 2;
+	    else if (p[1] == '&')
+		lexargs[argc++] = OP_DUPOUT, p += 2;
+	    else
+		lexargs[argc++] = OP_OUT, p++;
+	    continue;
+	}
 
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-	buf++;
-	delim = strchr(buf, '\'');
-    }
-    else {
-	delim = strchr(buf, ' ');
+	/* copy one word into buf, dropping its quotes and escapes */
+	word = buf;
+	quote = 0;
+	lit = 1;		/* nothing quoted, escaped or expanded yet */
+	while (*p) {
+	    if (*p == '=' && lit) {	/* NAME= as typed: maybe an assignment */
+		*buf = '\0';
+		n = buf > word && var_namelen(word) == buf - word;
+		*buf++ = n ? ASSIGN : '=';
+		p++;
+		lit = 0;
+		continue;
+	    }
+	    if (*p == '\\' || *p == '\'' || *p == '"' || *p == '$' ||
+		*p == '*' || *p == '?' || *p == '[')
+		lit = 0;
+	    if (quote == '\'') {
+		if (*p == '\'')
+		    quote = 0, p++;
+		else
+		    *buf++ = *p++;
+	    }
+	    else if (*p == '\\' && p[1] &&
+		     strchr(quote ? "$`\"\\\n" : special, p[1])) {
+		if (p[1] != '\n')	/* backslash-newline is dropped */
+		    *buf++ = p[1];
+		p += 2;
+	    }
+	    else if (*p == '$' && (n = varref(p + 1, &skip)) > 0) {	/* expanded when it runs */
+		*buf++ = quote ? QSUBST : SUBST;
+		memcpy(buf, p + 1 + (p[1] == '{'), n);
+		buf += n;
+		*buf++ = SUBST;
+		p += 1 + skip;
+	    }
+	    else if (quote == '"') {
+		if (*p == '"')
+		    quote = 0, p++;
+		else
+		    *buf++ = *p++;
+	    }
+	    else if (*p == '\'' || *p == '"')
+		quote = *p++;
+	    else if (strchr(" \t\n|&;", *p))
+		break;
+	    else if (*p == '*' || *p == '?' || *p == '[')	/* matched when it runs */
+		*buf++ = *p == '*' ? GLOBSTAR : *p == '?' ? GLOBONE : GLOBSET, p++;
+	    else
+		*buf++ = *p++;
+	}
+	if (quote) {
+	    if (!parsequiet)
+		printf("unexpected EOF while looking for matching `%c'\n", quote);
+	    return -1;
+	}
+	*buf++ = '\0';
+	lexargs[argc++] = word;
     }
 
-    while (delim) {
-	argv[argc++] = buf;
-	*delim = '\0';
-	buf = delim + 1;
-	while (*buf && (*buf == ' ')) /* ignore spaces */
-	       buf++;
+    /* move the list into the arena, where it stays put */
+    argv = arena_alloc((argc + 1) * sizeof(*argv));
+    if (argc > 0)		/* lexargs may not exist yet */
+	memcpy(argv, lexargs, argc * sizeof(*argv));
+    argv[argc] = NULL;
+    *argvp = argv;
+    if (srcp) {
+	*srcp = arena_alloc((argc + 1) * sizeof(**srcp));
+	if (argc > 0)
+	    memcpy(*srcp, lexsrc, argc * sizeof(**srcp));
+	(*srcp)[argc] = p;
+    }
 
-	if (*buf == '\'') {
-	    buf++;
-	    delim = strchr(buf, '\'');
-	}
-	else {
-	    delim = strchr(buf, ' ');
+    /* every list operator needs a command in front of it */
+    for (i = 0; i < argc; i++) {
+	if (islistop(argv[i]) && (i == 0 || islistop(argv[i-1]))) {
+	    if (!parsequiet)
+		printf("syntax error near unexpected token '%s'\n", argv[i]);
+	    return -1;
 	}
     }
-    argv[argc] = NULL;
-    
-    if (argc == 0)  /* ignore blank line */
-	return 1;
+    if (argc > 0 && (argv[argc-1] == OP_AND || argv[argc-1] == OP_OR)) {
+	if (!parsequiet)
+	    printf("syntax error near unexpected token 'newline'\n");
+	return -1;
+    }
 
-    /* should the job run in the background? */
-    if ((bg = (*argv[argc-1] == '&')) != 0) {
+    /* should the last command run in the background? */
+    bg = argc == 0 ? 0 : argv[argc-1] == OP_BG ? 1 : argv[argc-1] == OP_CAPTURE ? 2 : 0;
+    if (bg)
 	argv[--argc] = NULL;
-    }
     return bg;
 }
 
-/* 
+/* isredir - True if word is a redirection operator from parseline */
+static int isredir(char *word)
+{
+    return word == OP_IN || word == OP_OUT || word == OP_APPEND ||
+	word == OP_HERE || word == OP_DUPIN || word == OP_DUPOUT;
+}
+
+/* substval - The value of the $? or variable name (of length n) at name */
+static const char *substval(const char *name, size_t n, const char *status)
+{
+    struct var_t *vp;
+
+    if (*name == '?')
+	return status;
+    return (vp = var_find(name, n)) != NULL ? vp->entry + n + 1 : "";
+}
+
+/*
+ * expand - Replace each $? and $NAME that parseline marked in the words
+ *    of argv with the exit status of the last command or the value of
+ *    the variable, and each word with a glob in it with the file names
+ *    it matches, if there are any. A word that changes is copied into
+ *    the command arena; the others are left alone. Returns argv, or a
+ *    new one in the arena if a glob matched.
+ *
+ * As in sh, a word of nothing but unquoted variables that are empty is
+ * dropped, unless it names a redirection's file. Unlike sh, a value is
+ * never split into words or matched against file names. A redirection's
+ * target is never split into several words, so its globs are taken
+ * literally too, and so are those in a NAME=value word, which may be an
+ * assignment.
+ */
+char **expand(char **argv)
+{
+    char status[16], **v, **out, *prev = NULL, *word, *p, *q;
+    size_t len;
+    int keep, i;
+
+    snprintf(status, sizeof(status), "%d", laststatus);
+    for (v = out = argv; *v; prev = *v++) {
+	if (strpbrk(*v, "\001\005") == NULL) {
+	    *out++ = *v;
+	    continue;
+	}
+	for (p = *v, len = 0, keep = 0; *p; p++) {	/* measure it first */
+	    if (*p == SUBST || *p == QSUBST) {
+		keep |= *p == QSUBST;
+		q = strchr(++p, SUBST);
+		len += strlen(substval(p, q - p, status));
+		p = q;
+	    }
+	    else
+		len++, keep = 1;
+	}
+	if (len == 0 && !keep && !(prev && isredir(prev)))
+	    continue;
+	word = *v;		/* *out may be *v */
+	q = *out++ = arena_alloc(len + 1);
+	for (p = word; *p; p++) {
+	    if (*p == SUBST || *p == QSUBST) {
+		p++;
+		q = stpcpy(q, substval(p, strchr(p, SUBST) - p, status));
+		p = strchr(p, SUBST);
+	    }
+	    else
+		*q++ = *p;
+	}
+	*q = '\0';
+    }
+    *out = NULL;
+
+    for (i = 0; argv[i] && strpbrk(argv[i], "\002\003\004") == NULL; i++)
+	;
+    if (argv[i] == NULL)	/* the usual case: no globs */
+	return argv;
+    nglobv = 0;
+    for (i = 0; argv[i]; i++) {
+	if (strpbrk(argv[i], "\002\003\004") == NULL)
+	    glob_push(argv[i]);
+	else if ((i > 0 && isredir(argv[i-1])) || strchr(argv[i], ASSIGN) ||
+		 glob(argv[i]) == 0)
+	    glob_push(glob_unmark(argv[i]));	/* no match: the word as typed */
+    }
+    glob_push(NULL);
+    v = arena_alloc(nglobv * sizeof(*v));
+    memcpy(v, globv, nglobv * sizeof(*v));
+    return v;
+}
+
+/* isfdword - True if word is a descriptor in front of a redirection */
+static int isfdword(char *word)
+{
+    return word >= fdwords[0] && word < fdwords[10];
+}
+
+/*
+ * assign_unmark - word with parseline's ASSIGN mark, if it has one,
+ *    turned back into =, in a copy in the command arena
+ */
+static char *assign_unmark(char *word)
+{
+    char *copy, *p;
+
+    if ((p = strchr(word, ASSIGN)) == NULL)
+	return word;
+    copy = strcpy(arena_alloc(strlen(word) + 1), word);
+    copy[p - word] = '=';
+    return copy;
+}
+
+/*
+ * parsepipe - Split the argv list built by parseline into the stages
+ *    of a pipeline, at each | word, and take the redirections and the
+ *    NAME=value words in front of the command out of each stage's argv.
+ *    A command that has only those (and no pipe) has an empty argv.
+ *    Returns the stages, allocated in the command arena, and sets *np
+ *    to their number; or returns NULL after printing a message if a
+ *    stage or redirection is incomplete.
+ *
+ * Only a word parseline marked with ASSIGN is taken for a NAME=value,
+ * so one that came from a variable or a file name never is; the mark
+ * becomes = again in every word.
+ */
+struct launch_t *parsepipe(char **argv, int *np)
+{
+    struct launch_t *stages, *sp;
+    struct redir_t *r;
+    char **out = argv, **as, *bad = NULL;
+    int i, n = 1, nr = 0;
+
+    for (i = 0; argv[i]; i++) {
+	n += argv[i] == OP_PIPE;
+	nr += isredir(argv[i]);
+    }
+    stages = arena_alloc(n * sizeof(*stages));
+    r = arena_alloc(nr * sizeof(*r));
+    as = arena_alloc(i * sizeof(*as));
+
+    /* squeeze each stage's words together in place */
+    sp = stages;
+    sp->argv = out;
+    sp->redirs = r;
+    sp->nredirs = 0;
+    sp->assigns = as;
+    sp->nassigns = 0;
+    for (i = 0; !bad && argv[i]; i++) {
+	if (argv[i] == OP_PIPE) {
+	    *out++ = NULL;
+	    if (sp->argv[0] == NULL)
+		bad = "|";
+	    sp++;
+	    sp->argv = out;
+	    sp->redirs = r;
+	    sp->nredirs = 0;
+	    sp->assigns = as;
+	    sp->nassigns = 0;
+	}
+	else if (isredir(argv[i]) || isfdword(argv[i])) {
+	    r->fd = argv[i] == OP_IN || argv[i] == OP_HERE || argv[i] == OP_DUPIN ? 0 : 1;
+	    if (!isredir(argv[i]))	/* an explicit descriptor */
+		r->fd = argv[i++][0] - '0';
+	    r->op = argv[i++];
+	    r->word = argv[i];
+	    if (r->word == NULL || r->word == OP_PIPE || isredir(r->word) ||
+		isfdword(r->word))
+		bad = r->word ? r->word : "newline";
+	    else if ((r->op == OP_DUPIN || r->op == OP_DUPOUT) &&
+		     (!isdigit((unsigned char)r->word[0]) || r->word[1]))
+		bad = r->word;
+	    else
+		r->word = assign_unmark(r->word);
+	    r++;
+	    sp->nredirs++;
+	}
+	else if (out == sp->argv && argv[i][var_namelen(argv[i])] == ASSIGN) {
+	    *as++ = assign_unmark(argv[i]);	/* NAME=value before the command */
+	    sp->nassigns++;
+	}
+	else
+	    *out++ = assign_unmark(argv[i]);
+    }
+    *out = NULL;
+    if (!bad && sp->argv[0] == NULL && (sp > stages || sp->nassigns == 0))
+	bad = sp > stages ? "|" : "newline";
+    if (bad) {
+	printf("syntax error near unexpected token '%s'\n", bad);
+	return NULL;
+    }
+    for (sp = stages; sp < stages + n; sp++)
+	sp->envp = sp->nassigns && sp->argv[0] ? var_env(envv, sp->assigns, sp->nassigns) : NULL;
+    *np = n;
+    return stages;
+}
+
+/*
+ * arena_alloc - Allocate n bytes in the command arena. They stay put
+ *    until the next arena_reset, as a full block is never moved:
+ *    another one is chained in front of it.
+ */
+void *arena_alloc(size_t n)
+{
+    struct ablock_t *b;
+    void *p;
+
+    n = (n + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (arena == NULL || arena->size - arena->used < n) {
+	size_t size = n > ARENABLOCK ? n : ARENABLOCK;
+
+	if ((b = malloc(sizeof(*b) + size)) == NULL)
+	    unix_error("malloc error");
+	b->next = arena;
+	b->size = size;
+	b->used = 0;
+	arena = b;
+    }
+    p = arena->data + arena->used;
+    arena->used += n;
+    return p;
+}
+
+/*
+ * arena_reset - Free everything in the command arena at once. The
+ *    first block is kept for the next command.
+ */
+void arena_reset(void)
+{
+    struct ablock_t *b;
+
+    while (arena && arena->next) {
+	b = arena;
+	arena = b->next;
+	free(b);
+    }
+    if (arena)
+	arena->used = 0;
+}
+
+/* 
  * builtin_cmd - If the user has typed a built-in command then execute
  *    it immediately.  
  */
 int builtin_cmd(char **argv) 
 {
-	if(strcmp(argv[0],"quit")==0)	/* typing 'quit' on the command line would terminate the shell */
-	{
-		for(int i=0 ; i<MAXJOBS; i++)
-		{
-			if(jobs[i].state==ST)	/* if stopped jobs are present, don't quit but return 1 */
-			{
-				printf("There are stopped jobs\n");
-				return 1;
-			}
-		}
-		exit(0);	/* quit if no stopped jobs present */
-	}
-	
-	else if((strcmp(argv[0],"fg")==0) || (strcmp(argv[0],"bg")==0))	/* typing 'fg' or 'bg' on the command line calls do_bgfg function */
+	struct builtin_t *b = getbuiltin(argv[0]);	/* one hash probe and one strcmp */
+	if(b == NULL)
+		return 0;     /* if not a builtin command */
+	laststatus = b->fn(argv);	/* its exit status is $? */
+	return 1;
+}
+
+/*
+ * do_quit - typing 'quit' on the command line would terminate the shell
+ */
+int do_quit(char **argv)
+{
+	if(jobcount[ST] > 0)	/* if stopped jobs are present, don't quit */
 	{
-		do_bgfg(argv);
+		printf("There are stopped jobs\n");
 		return 1;
 	}
-	
-	else if(strcmp(argv[0],"jobs")==0)	/* typing 'jobs' on the command line prints the job table */
-	{
+	exit(0);	/* quit if no stopped jobs present */
+}
+
+/*
+ * do_jobs - typing 'jobs' on the command line prints the job table
+ */
+int do_jobs(char **argv)
+{
+	if(argv[1] && strcmp(argv[1],"-l")==0)	/* 'jobs -l' adds resource usage and recently finished jobs */
+		listjobs_usage(jobs);
+	else
 		listjobs(jobs);
-		return 1;
-	}
-	return 0;     /* if not a builtin command */
+	return 0;
 }
 
 /* 
  * do_bgfg - Execute the builtin bg and fg commands
  */
-void do_bgfg(char **argv) 
+int do_bgfg(char **argv) 
 {
 	/* error handling section */
 	if(!argv[1])	/* if no arguement is provided after fg/bg */
 	{
 		printf("%s command requires PID or %%jobid argument\n",argv[0]); 
-		return;
+		return 1;
 	}
 	else
 	{
@@ -343,7 +1688,7 @@ void do_bgfg(char **argv)
 				if(argv[1][i]<'0' || argv[1][i]>'9')	/* error checking if argument is not a number */
 				{
 					printf("%s: argument must be a PID or %%jobid\n",argv[0]);
-					return;
+					return 1;
 				}
 				num=num*10+(argv[1][i]-'0');	/* inplace of using atoi function */
 				i++;
@@ -352,7 +1697,7 @@ void do_bgfg(char **argv)
 			if(p==NULL)
 			{
 				printf("%s : No such job\n",argv[1]);
-				return;
+				return 1;
 			}
 		}
 		else
@@ -363,7 +1708,7 @@ void do_bgfg(char **argv)
 				if(argv[1][i]<'0' || argv[1][i]>'9')	/* error checking if argument is not a number */
 				{
 					printf("%s: argument must be a PID or %%jobid\n",argv[0]);
-					return;
+					return 1;
 				}
 				num=num*10+(argv[1][i]-'0');	/* inplace of using atoi function */
 				i++;
@@ -372,7 +1717,7 @@ void do_bgfg(char **argv)
 			if(p==NULL)
 			{
 				printf("(%s) : No such process\n", argv[1]);		
-				return;
+				return 1;
 			}
 		}
 	}
@@ -381,179 +1726,4211 @@ void do_bgfg(char **argv)
 	/*
 		When the bg command is executed,the stopped process resumes execution on receiveing the SIGCONT signal and runs in the background.
 		
-		bg maybe followed by job id or process id, so that needs to be checked first before changing the status of any job.
+		bg maybe followed by job id or process id; the error handling section above has already checked that the job exists.
 	*/
-	if(!strcmp(*argv,"bg")) {
-		int jid = atoi(*(argv+1)+1); /* converting argument to int */
-		
-		/* if jid of the job is mentioned as the argument */
-		if(argv[1][0] == '%') 
-		{
-			kill(-(jobs[jid-1].pid),SIGCONT);	/* sending SIGCONT to the job */
-			jobs[jid-1].state = BG;		/* change status of job to 'BG' */
-			printf("[%d] (%d) %s",jid,jobs[jid-1].pid,jobs[jid-1].cmdline);			
+	struct job_t *p;
+	if(argv[1][0] == '%')	/* if jid of the job is mentioned as the argument */
+		p = getjobjid(jobs,atoi(argv[1]+1));
+	else	/* if pid of the job is mentioned as the argument */
+		p = getjobpid(jobs,atoi(argv[1]));
+	pid_t pid = p->pid;
+	int jid = p->jid;
+
+	/*
+		A queued job hasn't started yet (it may have been stopped with kill -STOP while waiting). bg puts it back at the front of the queue; fg starts it right away in the foreground.
+	*/
+	if(pid == 0) {
+		if(!strcmp(*argv,"bg")) {
+			if(p->state == ST)
+				setjobstate(jobs,p,QU);
+			p->prio = ++queueprio;
+			printf("[%d] (0) Queued %s",jid,getjobinfo(p)->cmd->text);
+			sched_run();
 		}
-		
-		/* if pid of the job is mentioned as the argument */
-		else 
+		else if(startjob(p,FG))
 		{
-			pid_t pid = jid;
-			jid = pid2jid(pid);	/* obtaining jid from the given pid of process */
-			kill(-pid,SIGCONT);	/* sending SIGCONT to the job */
-			jobs[jid-1].state = BG;		/* change status of job to 'BG' */
-			printf("[%d] (%d) %s",jid,pid,jobs[jid-1].cmdline);
+			waitfg(p->pid);
+			return laststatus;
 		}
+		return 0;
+	}
+
+	place_apply(p);	/* back on its CPUs before it runs again */
+	sched_bgfg(p,!strcmp(*argv,"bg"));	/* -d: demoted in the background, promoted in the foreground */
+	cg_freeze(p,0);	/* thaw it if ctrl-z froze it; SIGCONT still wakes one a signal stopped */
+	if(!strcmp(*argv,"bg")) {
+		signaljob(p,SIGCONT);	/* sending SIGCONT to the job */
+		setjobstate(jobs,p,BG);		/* change status of job to 'BG' */
+		printf("[%d] (%d) %s",jid,pid,getjobinfo(p)->cmd->text);
 	}
 	
 	/*
 		When the fg command is executed,the stopped process resumes execution on receiveing the SIGCONT signal and runs in the foreground.
-		
-		fg maybe followed by job id or process id, so that needs to be checked first before changing the status of any job.
-		
 	*/
 	else if(!strcmp(*argv,"fg")) {
-		int jid = atoi(*(argv+1)+1); /* converting argument into int */
-		pid_t pid = 0;
-		
-		/* if jid of the job is mentioned as the argument */
-		if(argv[1][0] == '%') 
+		signaljob(p,SIGCONT);	/* sending SIGCONT to the job */ 
+		setjobstate(jobs,p,FG);		/* change status of job to 'FG' */
+		waitfg(pid); /* calling waitfg function ensures that there is only one foreground process running at one time */
+		return laststatus;	/* fg's own status is the job's */
+	}	
+	return 0;
+}
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process
+ *
+ * Rather than polling the job table, run the event loop: the signalfd
+ * wakes us as soon as the child changes state, and sigchld_handler
+ * updates the job table from there.
+ */
+
+void waitfg(pid_t pid)
+{
+  
+    struct job_t *p;
+    p = getjobpid(jobs,pid);	/* pinter to the entry in the job table of the job corresponding to pid */
+    while(p!=NULL&&(p->state==FG))	/* looping until the state is no longer FG */ 
+        {
+          loop_once(1);	/* sleep until the next child, signal or timer event */
+          p = getjobpid(jobs,pid);
+        }
+        if(fgchanged)	/* how long after the reap the shell woke up */
+          stat_record(PH_WAKEUP,now_ns()-fgchanged);
+        fgchanged = 0;
+        return;
+   
+}
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
+ *     available zombie children, but doesn't wait for any other
+ *     currently running children to terminate.  
+ *
+ *     SIGCHLD is read from the signalfd, so this runs from the event
+ *     loop rather than in signal context, on the same thread as
+ *     notify_drain. It does a bounded amount of work: it only pushes
+ *     (pid, status, time) records into the notes[] ring, so a burst of
+ *     reaps is batched ahead of notify_drain.
+ */
+void sigchld_handler(int sig) 
+{
+	pid_t pid;
+	int status;	/* status contains information about the status of the job that is stopped or terminated */
+	struct rusage ru;	/* resources used by a terminated child */
+	unsigned tail = notetail;
+	long long start = now_ns();
+	
+	/*
+	waitpid checks if any child process is terminated or stopped without pausing the parent process and will reap all its child processes.
+	The handler only records what happened; notify_drain applies the records to the job list. If the ring fills up, the rest of the children are left for the next pass.
+	*/
+	notefull = 0;
+	while(tail - notehead < NOTERING) 
+	{		
+		if(usepidfd)	/* exits are reaped through the pidfds; only look for stops */
 		{
-			pid = jobs[jid-1].pid;	/* obtain pid of the job using job id jid */
-			kill(-(jobs[jid-1].pid),SIGCONT);	/* sending SIGCONT to the job */ 
-			jobs[jid-1].state = FG;		/* change status of job to 'FG' */
+			siginfo_t si;
+			si.si_pid = 0;
+			if(waitid(P_ALL,0,&si,WSTOPPED|WNOHANG) < 0 || si.si_pid == 0)
+				break;
+			pid = si.si_pid;
+			status = W_STOPCODE(si.si_status);
+			memset(&ru,0,sizeof(ru));
 		}
+		else if((pid = wait4(-1,&status,WNOHANG|WUNTRACED,&ru)) <= 0)
+			break;
+		struct note_t *n = &notes[tail % NOTERING];
+		n->pid = pid;
+		n->status = status;
+		n->when = now_ns();
+		getusage(&n->usage,&ru);
+		if(!WIFSTOPPED(status))
+			nreaps++;
+		notetail = ++tail;
+	}
+	if(tail - notehead == NOTERING)
+		notefull = 1;
+	stat_record(PH_REAP,now_ns()-start);
+	return;
+}
+
+/*
+ * pidfd_ready - A child's pidfd is readable, so the child has exited.
+ *     Reap exactly that child with waitid(P_PIDFD) and queue its
+ *     status, so no exit needs a scan over all children.
+ */
+void pidfd_ready(int fd, unsigned events, void *arg)
+{
+	siginfo_t si;
+	struct rusage ru;
+	long long start = now_ns();
+	
+	si.si_pid = 0;
+	if(notetail - notehead == NOTERING)
+		notify_drain();	/* make room */
+	
+	/* the raw system call also returns the child's rusage, like wait4 */
+	if(syscall(SYS_waitid,P_PIDFD,fd,&si,WEXITED|WNOHANG,&ru) == 0 && si.si_pid != 0)
+	{
+		struct note_t *n = &notes[notetail % NOTERING];
+		n->pid = si.si_pid;
+		n->status = si.si_code == CLD_EXITED ? W_EXITCODE(si.si_status,0)
+			: si.si_status | (si.si_code == CLD_DUMPED ? WCOREFLAG : 0);
+		n->when = now_ns();
+		getusage(&n->usage,&ru);
+		nreaps++;
+		notetail++;
+		stat_record(PH_REAP,n->when-start);
+	}
+	notify_drain();	/* also closes fd */
+}
+
+/*
+ * notify_drain - Apply the status records queued by sigchld_handler to
+ *     the job list, in the order the children were reaped, and report
+ *     stopped and terminated jobs. The notifications for a whole batch
+ *     go out in one writev, after anything already buffered in stdout.
+ */
+void notify_drain(void)
+{
+	struct iovec iov[NOTEBATCH];
+	char lines[NOTEBATCH][64];
+	int nlines = 0;
+	unsigned head = notehead;
+	unsigned tail = notetail;
+	
+	for(; head != tail; head++) 
+	{		
+		struct note_t *n = &notes[head % NOTERING];
+		pid_t pid = n->pid;
+		int status = n->status;
+		int jid;	/* jid of the job being considered */
+		int len = 0;
+		int wasfg;	/* its status goes to $? */
 		
-		/* if pid of the job is mentioned as the argument */
-		else 
+		struct job_t *job = getjobpid(jobs,pid);
+		if(job == NULL)	/* not one of our jobs */
+			continue;
+		struct jobinfo_t *ji = getjobinfo(job);
+		nnotes++;
+		stat_record(PH_NOTIFY,now_ns()-n->when);	/* time the record spent queued */
+		jid = job->jid;	/* obtain jid of the job from pid */
+		wasfg = job->state == FG;
+		if(wasfg) 	/* if the is in foreground state */
 		{
-			pid_t pid = jid;
-			jid = pid2jid(pid);	/* obtaining jid from the given pid of process */
-			kill(-pid,SIGCONT);	/* sending SIGCONT to the job */
-			jobs[jid-1].state = FG;		/* change status of job to 'FG'*/
-		}	
-		waitfg(pid); /* calling waitfg function ensures that there is only one foreground process running at one time */
-	}	
+			check_if_fg = 1;
+			fgchanged = n->when;	/* for the wakeup statistics, if it is the last one */
+		}
+
+		/*
+			WIFSTOPPED checks if the job is stopped on receiving a signal. The state of the job is then changed to ST.
+			Every stage of a stopped pipeline reports in, but the job is only reported once.
+		*/
+		if(WIFSTOPPED(status)) 
+		{			
+			if(wasfg)
+				laststatus = 128 + WSTOPSIG(status);
+			if(job->state != ST)
+			{
+				setjobstate(jobs,job,ST);
+				len = snprintf(lines[nlines],sizeof(lines[0]),"Job [%d] (%d) stopped by signal %d\n", jid, job->pid, WSTOPSIG(status));
+			}
+		}
+
+		/* 	
+			WIFEXITED or WIFSIGNALED: the process terminated. The job is deleted from the joblist once all of its processes have.
+		 */
+		else
+		{
+			struct proc_t *p = ji->procs;
+			while(p->pid != pid)
+				p++;
+			p->done = 1;
+			p->status = status;
+			addusage(&ji->usage,&n->usage);
+			if(p->pidfd >= 0)	/* the pid may be reused now */
+			{
+				loop_unwatch(p->pidfd);
+				close(p->pidfd);
+				p->pidfd = -1;
+			}
+			if(--ji->nlive > 0)
+				continue;
+
+			/*
+				A job is reported as terminated by a signal if its last stage was.
+			*/
+			status = ji->procs[ji->nprocs-1].status;
+			pid = job->pid;
+			cg_account(job);	/* the cgroup's count, if it has one, is the whole job's */
+			recordjob(job,status,n->when);	/* for jobs -l and time */
+			if(ji->exitp)	/* someone like parallel is waiting for it */
+				*ji->exitp = status;
+			if(wasfg)
+				laststatus = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+			deletejob(jobs,pid);	
+			if(WIFSIGNALED(status))
+				len = snprintf(lines[nlines],sizeof(lines[0]),"Job [%d] (%d) terminated by signal %d\n",jid,pid,WTERMSIG(status));		
+		}
+
+		if(len > 0)
+		{
+			iov[nlines].iov_base = lines[nlines];
+			iov[nlines].iov_len = len;
+			if(++nlines == NOTEBATCH)	/* batch is full: write it out */
+			{
+				fflush(stdout);
+				writev(STDOUT_FILENO,iov,nlines);
+				nlines = 0;
+			}
+		}
+	}
+	notehead = head;	/* free the consumed records */
+	
+	if(nlines > 0)
+	{
+		fflush(stdout);
+		if(writev(STDOUT_FILENO,iov,nlines) < 0)
+			unix_error("writev error");
+	}
+	sched_run();	/* start queued jobs in the run slots just freed */
+	return;
+}
+
+/* 
+ * sigint_handler - The kernel sends a SIGINT to the shell whenver the
+ *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    to the foreground job.  
+ */
+void sigint_handler(int sig) 
+{
+	pid_t pid = fgpid(jobs);	/* pid of foreground job */
+	if(pid == 0)	/* no foreground job: kill(-0) would signal the shell's own group */
+	{
+		interrupted = 1;	/* but interrupt a builtin like wait or sleep */
+		return;
+	}
+	/* 
+	SIGINT is sent to process group of the foreground job 
+	*/
+	if(signaljob(getjobpid(jobs,pid), SIGINT) < 0)
+		unix_error("kill error\n"); 
+
+	return;
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     the user types ctrl-z at the keyboard. Catch it and suspend the
+ *     foreground job by sending it a SIGTSTP.  
+ */
+void sigtstp_handler(int sig) 
+{
+	pid_t pid = fgpid(jobs);	/* pid of foreground job */
+	if(pid == 0)	/* no foreground job to stop */
+		return;
+	/*
+	A job with a cgroup is frozen instead. No SIGCHLD comes for that, so the job is marked stopped here, as notify_drain would.
+	*/
+	struct job_t *job = getjobpid(jobs,pid);
+	if(cg_freeze(job,1) == 0)
+	{
+		laststatus = 128 + SIGTSTP;
+		setjobstate(jobs,job,ST);
+		printf("Job [%d] (%d) stopped by signal %d\n",job->jid,pid,SIGTSTP);
+		fflush(stdout);
+		return;
+	}
+        /* 
+	SIGTSTP is sent to process group of the foreground job 
+	*/
+	if(signaljob(getjobpid(jobs,pid),SIGTSTP) < 0)
+		unix_error("kill error\n"); 
+	//jobs[pid2jid(pid)-1].state = ST;	/* state of job is changed to stopped */	
+	    
 	return;
 }
 
-/* 
- * waitfg - Block until process pid is no longer the foreground process
+/*********************
+ * End signal handlers
+ *********************/
+
+/*********************
+ * Event loop routines
+ *********************/
+
+/*
+ * loop_init - Create the epoll instance and route SIGCHLD, SIGINT and
+ *    SIGTSTP through a signalfd. The signals stay blocked for the life
+ *    of the shell; children restore origmask before they exec.
+ */
+void loop_init(void)
+{
+    sigset_t mask;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	unix_error("epoll_create1 error");
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    if (sigprocmask(SIG_BLOCK, &mask, &origmask) < 0)
+	unix_error("sigprocmask error");
+    if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+	unix_error("signalfd error");
+    if (loop_watch(sigfd, EPOLLIN, signal_ready, NULL) < 0)
+	unix_error("epoll_ctl error");
+
+    /* stdin is only watched while we wait for a command line; regular
+     * files can't be added to an epoll set and are read directly. It is
+     * one-shot because a pipe whose writer has gone reports EPOLLHUP
+     * even with no events requested, which would spin waitfg */
+    if (loop_watch(STDIN_FILENO, EPOLLONESHOT, stdin_ready, NULL) < 0)
+	stdin_pollable = 0;
+}
+
+/*
+ * loop_watch - Call fn whenever one of events is pending on fd
+ */
+int loop_watch(int fd, unsigned events, watcher_t *fn, void *arg)
+{
+    struct epoll_event ev;
+
+    if (fd >= nwatches) {
+	int n = nwatches ? nwatches : 16;
+	struct watch_t *w;
+
+	while (n <= fd)
+	    n *= 2;
+	if ((w = realloc(watches, n * sizeof(*w))) == NULL)
+	    unix_error("realloc error");
+	memset(w + nwatches, 0, (n - nwatches) * sizeof(*w));
+	watches = w;
+	nwatches = n;
+    }
+
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	return -1;
+    watches[fd].fn = fn;
+    watches[fd].arg = arg;
+    return 0;
+}
+
+/* loop_modify - Change the events we are waiting for on a watched fd */
+int loop_modify(int fd, unsigned events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/* loop_unwatch - Stop watching fd */
+void loop_unwatch(int fd)
+{
+    if (fd < 0 || fd >= nwatches || watches[fd].fn == NULL)
+	return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    watches[fd].fn = NULL;
+    watches[fd].arg = NULL;
+}
+
+/* 
+ * loop_timer - Call fn(arg) once, ms milliseconds from now. Returns a
+ *    timer id for loop_cancel, or -1 if all timer slots are in use.
+ */
+int loop_timer(int ms, timer_fn_t *fn, void *arg)
+{
+    int i;
+
+    for (i = 0; i < MAXTIMERS; i++) {
+	if (timers[i].when == 0) {
+	    timers[i].when = now_ns() + (long long)ms * 1000000;
+	    timers[i].fn = fn;
+	    timers[i].arg = arg;
+	    return i;
+	}
+    }
+    return -1;
+}
+
+/* loop_cancel - Cancel a pending timer */
+void loop_cancel(int id)
+{
+    if (id >= 0 && id < MAXTIMERS)
+	timers[id].when = 0;
+}
+
+/*
+ * loop_once - Wait for one batch of events and dispatch them. If block
+ *    is false, only dispatch what is already pending.
+ */
+void loop_once(int block)
+{
+    struct epoll_event evs[MAXEVENTS];
+    long long now, next = 0;
+    int i, n, timeout = block ? -1 : 0;
+
+    for (i = 0; i < MAXTIMERS; i++)
+	if (timers[i].when && (next == 0 || timers[i].when < next))
+	    next = timers[i].when;
+    if (next && block) {
+	now = now_ns();
+	timeout = next > now ? (int)((next - now + 999999) / 1000000) : 0;
+    }
+
+    if ((n = epoll_wait(epfd, evs, MAXEVENTS, timeout)) < 0) {
+	if (errno != EINTR)
+	    unix_error("epoll_wait error");
+	n = 0;
+    }
+    for (i = 0; i < n; i++) {
+	int fd = evs[i].data.fd;
+
+	/* an earlier callback in this batch may have unwatched fd */
+	if (fd < nwatches && watches[fd].fn)
+	    watches[fd].fn(fd, evs[i].events, watches[fd].arg);
+    }
+
+    if (next) {
+	now = now_ns();
+	for (i = 0; i < MAXTIMERS; i++) {
+	    if (timers[i].when && timers[i].when <= now) {
+		timers[i].when = 0;
+		timers[i].fn(timers[i].arg);
+	    }
+	}
+    }
+}
+
+/*
+ * signal_ready - Drain the signalfd and run the matching handlers.
+ *    Several SIGCHLDs in one batch need only one reaping pass.
+ */
+void signal_ready(int fd, unsigned events, void *arg)
+{
+    struct signalfd_siginfo si[16];
+    ssize_t n;
+    int i, chld = 0;
+
+    while ((n = read(fd, si, sizeof(si))) > 0) {
+	for (i = 0; i < n / (ssize_t)sizeof(si[0]); i++) {
+	    switch (si[i].ssi_signo) {
+	    case SIGCHLD:
+		chld = 1;
+		break;
+	    case SIGINT:
+		sigint_handler(SIGINT);
+		break;
+	    case SIGTSTP:
+		sigtstp_handler(SIGTSTP);
+		break;
+	    }
+	}
+    }
+    /* reap into the ring and drain it, until no child is left waiting */
+    while (chld) {
+	sigchld_handler(SIGCHLD);
+	notify_drain();
+	chld = notefull;
+    }
+}
+
+/* stdin_ready - Note that a command line can be read without blocking */
+void stdin_ready(int fd, unsigned events, void *arg)
+{
+    input_ready = 1;
+}
+
+/*
+ * getcmdline - Return the next line of input, with its newline, running
+ *    the event loop while we wait for it. The line stays valid until
+ *    the next call. Lines longer than maxline (ARG_MAX, as nothing
+ *    longer could be exec'd) are reported and skipped. Returns NULL at
+ *    end of file.
+ */
+char *getcmdline(void)
+{
+    char *nl;
+    size_t len, scan = inpos;	/* inbuf[inpos..scan) has no newline */
+    ssize_t n;
+    int toolong = 0;
+
+    while (1) {
+	nl = scan < inlen ? memchr(inbuf + scan, '\n', inlen - scan) : NULL;
+	if (nl != NULL) {
+	    if (!toolong && (size_t)(nl - (inbuf + inpos)) < maxline)
+		break;
+	    printf("Command line too long\n");
+	    fflush(stdout);
+	    toolong = 0;
+	    scan = inpos = nl - inbuf + 1;
+	    continue;
+	}
+	if (input_eof)
+	    break;
+	scan = inlen;
+	if (inlen - inpos > maxline) {	/* drop it up to its newline */
+	    toolong = 1;
+	    scan = inpos = inlen;
+	}
+
+	/* compact and grow the buffer before reading more */
+	if (inpos > 0) {
+	    memmove(inbuf, inbuf + inpos, inlen - inpos);
+	    inlen -= inpos;
+	    scan -= inpos;
+	    inpos = 0;
+	}
+	if (incap - inlen < MAXLINE) {
+	    incap = incap ? incap * 2 : 4 * MAXLINE;
+	    if ((inbuf = realloc(inbuf, incap)) == NULL)
+		unix_error("realloc error");
+	}
+
+	if (stdin_pollable) {
+	    input_ready = 0;
+	    loop_modify(STDIN_FILENO, EPOLLIN | EPOLLONESHOT);
+	    while (!input_ready)	/* disarmed again once it fires */
+		loop_once(1);
+	}
+	if ((n = read(STDIN_FILENO, inbuf + inlen, incap - inlen)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    app_error("read error");
+	}
+	if (n == 0)
+	    input_eof = 1;
+	inlen += n;
+    }
+
+    if (toolong || inlen - inpos > maxline)
+	printf("Command line too long\n");
+    if (toolong || inlen - inpos > maxline || inpos == inlen)
+	return NULL;
+    len = nl ? (size_t)(nl - (inbuf + inpos)) + 1 : inlen - inpos;
+    if (len + 2 > linecap) {
+	linecap = len + 2 > 2 * linecap ? len + 2 : 2 * linecap;
+	if ((linebuf = realloc(linebuf, linecap)) == NULL)
+	    unix_error("realloc error");
+    }
+    memcpy(linebuf, inbuf + inpos, len);
+    inpos += len;
+    if (linebuf[len-1] != '\n')		/* unterminated last line */
+	linebuf[len++] = '\n';
+    linebuf[len] = '\0';
+    return linebuf;
+}
+
+/* now_ns - Read the monotonic clock in nanoseconds */
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/*************************
+ * End event loop routines
+ *************************/
+
+/*****************
+ * Launch routines
+ *****************/
+
+/*
+ * launch_init - Set up the posix_spawn attributes every child shares:
+ *    it gets its own process group and the signal mask the shell was
+ *    started with (the shell keeps SIGCHLD, SIGINT and SIGTSTP blocked).
+ */
+void launch_init(void)
+{
+    int fd;
+
+    if (posix_spawnattr_init(&spawnattr) != 0 ||
+	posix_spawnattr_setflags(&spawnattr, POSIX_SPAWN_SETPGROUP |
+				 POSIX_SPAWN_SETSIGMASK) != 0 ||
+	posix_spawnattr_setsigmask(&spawnattr, &origmask) != 0)
+	app_error("posix_spawnattr error");
+    if (verbose)
+	atexit(launch_report);
+
+    /* reap through pidfds if the kernel supports them */
+    if ((fd = pidfd_open(getpid(), 0)) >= 0) {
+	close(fd);
+	usepidfd = 1;
+    }
+}
+
+/*
+ * launch - Start lp->argv[0] in process group lp->pgid. Returns the
+ *    child's pid, or 0 (after printing a message) if it couldn't be
+ *    started.
+ *
+ * posix_spawn uses CLONE_VFORK, so launching doesn't copy the shell's
+ * page tables and returns only once the child has exec'd. The plain
+ * fork path is kept for children that must run shell code first, such
+ * as a builtin that is one stage of a pipeline.
+ *
+ * Bare command names are resolved through the path cache and exec'd
+ * by full path; a cached path that has gone stale is looked up again,
+ * found out before a fork or from posix_spawn's error.
+ * A child with lp->place starts out on those CPUs: posix_spawn has no
+ * attribute for that, so the shell takes the affinity on for the spawn.
+ * One with lp->sched is forked instead, as the shell could not take
+ * back a nice value or idle class it lent out that way; the shell sets
+ * it on the child, so it is in place before the child can run at all.
+ * One with lp->cg is forked too, and joins the cgroup itself before it
+ * execs, so nothing it starts can be left outside.
+ */
+pid_t launch(struct launch_t *lp)
+{
+    long long start = now_ns();
+    char *path = lp->argv[0];
+    struct pathent_t *pe = NULL;
+    struct builtin_t *b = getbuiltin(lp->argv[0]);
+    pid_t pid;
+    int i, err, retried = 0;
+
+ retry:
+    if (b == NULL && strchr(lp->argv[0], '/') == NULL) {
+	long long t = now_ns();
+	pe = path_lookup(lp->argv[0]);
+	stat_record(PH_LOOKUP, now_ns() - t);
+	if (pe == NULL || pe->path == NULL) {
+	    printf("%s : Command not found\n", lp->argv[0]);
+	    return 0;
+	}
+	path = pe->path;
+    }
+
+    if (usefork || b || lp->sched || lp->cg) {
+	/* the child can't come back for a retry, so check the cache first */
+	if (pe && pe->path && !pe->pinned && !retried &&
+	    access(path, X_OK) < 0 &&
+	    (errno == ENOENT || errno == ENOTDIR || errno == EACCES)) {
+	    path_forget(lp->argv[0]);	/* moved since we cached it */
+	    retried = 1;
+	    goto retry;
+	}
+	fflush(stdout);		/* don't let the child inherit buffered output */
+	if ((pid = fork()) < 0)
+	    unix_error("fork error");
+	if (pid == 0) {
+	    setpgid(0, lp->pgid);
+	    if (lp->closefd >= 0)	/* else a builtin never gets SIGPIPE */
+		close(lp->closefd);
+	    if (lp->infd >= 0)
+		dup2(lp->infd, STDIN_FILENO);
+	    if (lp->outfd >= 0)
+		dup2(lp->outfd, STDOUT_FILENO);
+	    if (lp->errfd >= 0)
+		dup2(lp->errfd, STDERR_FILENO);
+	    for (i = 0; i < lp->nredirs; i++)
+		dup2(lp->redirs[i].src, lp->redirs[i].fd);
+	    if (lp->place)
+		sched_setaffinity(0, sizeof(cpu_set_t), &lp->place->set);
+	    if (lp->cg)		/* the parent says if it fails */
+		write(lp->cg->procsfd, "0", 1);
+	    
+	    /* restoring the signal mask the shell was started with */
+	    if (sigprocmask(SIG_SETMASK, &origmask, NULL) < 0)
+		unix_error("sigprocmask error");
+	    if (b) {		/* a builtin in a pipeline runs in the child */
+		inchild = 1;
+		err = b->fn(lp->argv);
+		fflush(stdout);
+		_exit(err);
+	    }
+	    execve(path, lp->argv, lp->envp ? lp->envp : environ);
+	    printf(errno == E2BIG ? "%s : Argument list too long\n" :
+		   "%s : Command not found\n", lp->argv[0]);
+	    fflush(stdout);
+	    _exit(127);
+	}
+	setpgid(pid, lp->pgid);	/* also in the parent, so there's no race */
+	if (lp->sched && sched_set(pid, lp->sched) < 0)	/* before prio can */
+	    printf("%s: cannot set scheduling class: %s\n",
+		   lp->argv[0], strerror(errno));
+	if (lp->cg && cg_join(lp->cg, pid) < 0)	/* in both, like setpgid */
+	    printf("%s: cannot join cgroup: %s\n", lp->argv[0], strerror(errno));
+    }
+    else {
+	posix_spawn_file_actions_t fa, *fap = NULL;
+
+	if (lp->infd >= 0 || lp->outfd >= 0 || lp->errfd >= 0 || lp->nredirs > 0) {
+	    fap = &fa;
+	    posix_spawn_file_actions_init(fap);
+	    if (lp->infd >= 0)
+		posix_spawn_file_actions_adddup2(fap, lp->infd, STDIN_FILENO);
+	    if (lp->outfd >= 0)
+		posix_spawn_file_actions_adddup2(fap, lp->outfd, STDOUT_FILENO);
+	    if (lp->errfd >= 0)
+		posix_spawn_file_actions_adddup2(fap, lp->errfd, STDERR_FILENO);
+	    for (i = 0; i < lp->nredirs; i++)
+		posix_spawn_file_actions_adddup2(fap, lp->redirs[i].src,
+						 lp->redirs[i].fd);
+	}
+	posix_spawnattr_setpgroup(&spawnattr, lp->pgid);
+	if (lp->place)		/* no spawn attribute for it: lend it ours */
+	    sched_setaffinity(0, sizeof(cpu_set_t), &lp->place->set);
+	err = posix_spawn(&pid, path, fap, &spawnattr, lp->argv,
+			  lp->envp ? lp->envp : environ);
+	if (lp->place)
+	    sched_setaffinity(0, sizeof(cpu_set_t), &shellcpus);
+	if (fap)
+	    posix_spawn_file_actions_destroy(fap);
+	if (err != 0) {
+	    if (pe && pe->path && !pe->pinned && !retried &&
+		(err == ENOENT || err == ENOTDIR || err == EACCES)) {
+		path_forget(lp->argv[0]);	/* moved since we cached it */
+		retried = 1;
+		goto retry;
+	    }
+	    printf(err == E2BIG ? "%s : Argument list too long\n" :
+		   "%s : Command not found\n", lp->argv[0]);
+	    return 0;
+	}
+    }
+
+    nlaunches++;
+    launch_ns += now_ns() - start;
+    stat_record(PH_SPAWN, now_ns() - start);
+    return pid;
+}
+
+/*
+ * launch_pipeline - Launch each stage of a pipeline with its stdout
+ *    connected to the next stage's stdin. The stages share the process
+ *    group of the first one that starts. Fills in pids[] (0 for a
+ *    stage that couldn't be started) and returns how many started.
+ *
+ * The pipes are created close-on-exec, so each child keeps only the
+ * ends it was given as stdin and stdout. Every stage is placed on the
+ * CPUs in place, given the scheduling class in sched and put in the
+ * cgroup cg, if they aren't NULL.
+ */
+int launch_pipeline(struct launch_t *stages, int nstages, pid_t *pids, int capfd,
+		    struct place_t *place, struct schedattr_t *sched,
+		    struct cgroup_t *cg)
+{
+    struct launch_t *l;
+    pid_t pgid = 0;
+    int i, fds[2], infd = -1, n = 0;
+
+    for (i = 0; i < nstages; i++) {
+	l = &stages[i];
+	l->pgid = pgid;
+	l->infd = infd;
+	l->outfd = i == nstages-1 ? capfd : -1;
+	l->errfd = capfd;
+	l->closefd = -1;
+	l->place = place;
+	l->sched = sched;
+	l->cg = cg;
+	if (i < nstages-1) {
+	    if (pipe2(fds, O_CLOEXEC) < 0)
+		unix_error("pipe2 error");
+	    if (pipesize > 0)
+		fcntl(fds[1], F_SETPIPE_SZ, pipesize);
+	    l->outfd = fds[1];
+	    l->closefd = fds[0];
+	}
+
+	pids[i] = 0;
+	if (redir_open(l) == 0) {
+	    pids[i] = launch(l);
+	    redir_close(l);
+	}
+	if (pids[i] != 0) {
+	    if (pgid == 0)
+		pgid = pids[i];
+	    n++;
+	}
+
+	if (infd >= 0)
+	    close(infd);
+	if (i < nstages-1) {
+	    close(fds[1]);
+	    infd = fds[0];
+	}
+    }
+    return n;
+}
+
+/*
+ * launch_exec - Replace the shell with a single command that has no
+ *    redirections, with the signal mask the shell was started with.
+ *    Only returns after printing a message if the command can't run;
+ *    then it exits, as the command would have.
+ */
+void launch_exec(struct launch_t *lp)
+{
+    char *path = lp->argv[0];
+    struct pathent_t *pe;
+
+    if (strchr(path, '/') == NULL) {
+	if ((pe = path_lookup(path)) == NULL || pe->path == NULL) {
+	    printf("%s : Command not found\n", lp->argv[0]);
+	    fflush(stdout);
+	    exit(127);
+	}
+	path = pe->path;
+    }
+    if (lp->place)
+	sched_setaffinity(0, sizeof(cpu_set_t), &lp->place->set);
+    if (lp->sched && sched_set(0, lp->sched) < 0)
+	printf("%s: cannot set scheduling class: %s\n",
+	       lp->argv[0], strerror(errno));
+    fflush(stdout);
+    if (sigprocmask(SIG_SETMASK, &origmask, NULL) < 0)
+	unix_error("sigprocmask error");
+    execve(path, lp->argv, lp->envp ? lp->envp : environ);
+    printf(errno == E2BIG ? "%s : Argument list too long\n" :
+	   "%s : Command not found\n", lp->argv[0]);
+    fflush(stdout);
+    exit(127);
+}
+
+/* launch_report - Print launch throughput (-v) when the shell exits */
+void launch_report(void)
+{
+    if (nlaunches > 0 && !inchild)
+	printf("Launched %ld processes, %.1f us each (%.0f launches/sec)\n",
+	       nlaunches, launch_ns / 1e3 / nlaunches,
+	       nlaunches * 1e9 / launch_ns);
+}
+/*********************
+ * End launch routines
+ *********************/
+
+/**************************
+ * Builtin command routines
+ **************************/
+
+/*
+ * builtins - Every builtin command. BF_UTIL builtins are in-process
+ *    versions of common utilities: they save a fork and exec whenever a
+ *    script runs one, and -b also uses them for /bin/echo and friends.
+ */
+struct builtin_t builtins[] = {
+    { "quit",  do_quit,  0 },
+    { "fg",    do_bgfg,  0 },
+    { "bg",    do_bgfg,  0 },
+    { "jobs",  do_jobs,  0 },
+    { "hash",  do_hash,  0 },
+    { "cd",    do_cd,    0 },
+    { "wait",  do_wait,  0 },
+    { "echo",  do_echo,  BF_UTIL },
+    { "pwd",   do_pwd,   BF_UTIL },
+    { "kill",  do_kill,  BF_UTIL },
+    { "true",  do_true,  BF_UTIL },
+    { "false", do_false, BF_UTIL },
+    { "sleep", do_sleep, BF_UTIL },
+    { "stats", do_stats, 0 },
+    { "parallel", do_parallel, 0 },
+    { "joblog", do_joblog, 0 },
+    { "prio",  do_prio,  0 },
+    { "export", do_export, 0 },
+    { "unset", do_unset, 0 },
+};
+#define NBUILTINS (int)(sizeof(builtins) / sizeof(builtins[0]))
+
+/* builtin_slot - Perfect hash of builtin names -> index in builtins[] */
+signed char builtin_slot[1 << BUILTIN_BITS];
+
+/* builtin_hash - Seeded FNV-1a hash of a command name */
+static inline unsigned builtin_hash(const char *name)
+{
+    unsigned h = 2166136261u ^ BUILTIN_SEED;
+
+    while (*name)
+	h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h >> (32 - BUILTIN_BITS);
+}
+
+/*
+ * builtin_init - Fill in builtin_slot[]. BUILTIN_SEED was chosen so no
+ *    two names share a bucket; adding a builtin may need a new seed.
+ */
+void builtin_init(void)
+{
+    int i;
+    unsigned h;
+
+    memset(builtin_slot, -1, sizeof(builtin_slot));
+    for (i = 0; i < NBUILTINS; i++) {
+	h = builtin_hash(builtins[i].name);
+	if (builtin_slot[h] >= 0)
+	    app_error("builtin_init: hash collision, change BUILTIN_SEED");
+	builtin_slot[h] = i;
+    }
+}
+
+/*
+ * getbuiltin - Return the builtin that runs name, or NULL. With -b,
+ *    /bin/name and /usr/bin/name also run BF_UTIL builtins.
+ */
+struct builtin_t *getbuiltin(char *name)
+{
+    struct builtin_t *b;
+    int i, util = 0;
+
+    if (name[0] == '/') {
+	if (!preferbuiltins)
+	    return NULL;
+	if (strncmp(name, "/bin/", 5) == 0)
+	    name += 5;
+	else if (strncmp(name, "/usr/bin/", 9) == 0)
+	    name += 9;
+	else
+	    return NULL;
+	util = 1;
+    }
+    if ((i = builtin_slot[builtin_hash(name)]) < 0)
+	return NULL;
+    b = &builtins[i];
+    if (strcmp(b->name, name) != 0 || (util && !(b->flags & BF_UTIL)))
+	return NULL;
+    return b;
+}
+
+/* echoesc - Print the escape sequence at *sp for echo -e; 0 means \c */
+static int echoesc(char **sp)
+{
+    char *s = *sp;
+    int c, n;
+
+    switch (c = *s++) {
+    case 'a': c = '\a'; break;
+    case 'b': c = '\b'; break;
+    case 'c': return 0;
+    case 'e': c = 033; break;
+    case 'f': c = '\f'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    case 'v': c = '\v'; break;
+    case '\\': break;
+    case 'x':			/* \xHH: up to two hex digits */
+	if (!isxdigit((unsigned char)*s)) {
+	    putchar('\\');
+	    break;
+	}
+	for (c = n = 0; n < 2 && isxdigit((unsigned char)*s); n++, s++)
+	    c = c*16 + (isdigit((unsigned char)*s) ? *s - '0'
+			: tolower((unsigned char)*s) - 'a' + 10);
+	break;
+    case '0': case '1': case '2': case '3':
+    case '4': case '5': case '6': case '7':
+	/* \0NNN and \NNN: up to three octal digits */
+	n = (c == '0') ? 0 : 1;
+	c -= '0';
+	for (; n < 3 && *s >= '0' && *s <= '7'; n++)
+	    c = c*8 + (*s++ - '0');
+	break;
+    default:			/* not an escape: print it as is */
+	putchar('\\');
+	s--;
+	c = *s++;
+	if (c == '\0') {
+	    *sp = s-1;
+	    return 1;
+	}
+    }
+    putchar(c);
+    *sp = s;
+    return 1;
+}
+
+/* do_echo - Print the arguments: echo [-neE] [arg...] */
+int do_echo(char **argv)
+{
+    int i, nl = 1, esc = 0;
+    char *s;
+
+    for (i = 1; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+	for (s = argv[i]+1; *s == 'n' || *s == 'e' || *s == 'E'; s++)
+	    ;
+	if (*s)			/* not an option after all */
+	    break;
+	for (s = argv[i]+1; *s; s++) {
+	    if (*s == 'n')
+		nl = 0;
+	    else
+		esc = (*s == 'e');
+	}
+    }
+
+    for (; argv[i]; i++) {
+	if (!esc)
+	    fputs(argv[i], stdout);
+	else {
+	    for (s = argv[i]; *s; ) {
+		if (*s != '\\')
+		    putchar(*s++);
+		else {
+		    s++;
+		    if (!echoesc(&s))
+			return 0;	/* \c: stop printing */
+		}
+	    }
+	}
+	if (argv[i+1])
+	    putchar(' ');
+    }
+    if (nl)
+	putchar('\n');
+    return 0;
+}
+
+/* do_cd - Change the working directory: cd [dir] */
+int do_cd(char **argv)
+{
+    char *dir = argv[1], *cwd;
+
+    if (dir == NULL && (dir = var_get("HOME")) == NULL) {
+	printf("cd: HOME not set\n");
+	return 1;
+    }
+    if (chdir(dir) < 0) {
+	printf("cd: %s: %s\n", dir, strerror(errno));
+	return 1;
+    }
+    if ((cwd = getcwd(NULL, 0)) != NULL) {	/* however long it is */
+	var_set("PWD", 3, cwd, 1);
+	free(cwd);
+    }
+    return 0;
+}
+
+/* do_pwd - Print the working directory */
+int do_pwd(char **argv)
+{
+    char *cwd;
+
+    if ((cwd = getcwd(NULL, 0)) == NULL) {
+	printf("pwd: %s\n", strerror(errno));
+	return 1;
+    }
+    printf("%s\n", cwd);
+    free(cwd);
+    return 0;
+}
+
+/* signame - Map a signal name (INT, SIGINT) or number to a signal */
+static int signame(char *name)
+{
+    static struct { char *name; int sig; } sigs[] = {
+	{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT },
+	{ "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+	{ "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+	{ "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP },
+	{ "TSTP", SIGTSTP }, { "TTIN", SIGTTIN }, { "TTOU", SIGTTOU },
+    };
+    int i;
+
+    if (isdigit((unsigned char)name[0]))
+	return atoi(name);
+    if (strncmp(name, "SIG", 3) == 0)
+	name += 3;
+    for (i = 0; i < (int)(sizeof(sigs) / sizeof(sigs[0])); i++)
+	if (strcmp(sigs[i].name, name) == 0)
+	    return sigs[i].sig;
+    return -1;
+}
+
+/*
+ * kill_queued - Act out sig on a job that hasn't started yet. A stop
+ *    signal holds it back from the queue and CONT lets it go again;
+ *    a signal that would terminate a process drops the job.
+ */
+static void kill_queued(struct job_t *job, int sig)
+{
+    switch (sig) {
+    case 0:
+    case SIGCHLD:		/* ignored by default */
+    case SIGURG:
+    case SIGWINCH:
+	return;
+    case SIGCONT:
+	if (job->state == ST) {
+	    setjobstate(jobs, job, QU);
+	    sched_run();
+	}
+	return;
+    case SIGSTOP:
+    case SIGTSTP:
+    case SIGTTIN:
+    case SIGTTOU:
+	if (job->state == QU) {
+	    setjobstate(jobs, job, ST);
+	    printf("Job [%d] (0) stopped by signal %d\n", job->jid, sig);
+	}
+	return;
+    }
+    printf("Job [%d] (0) terminated by signal %d\n", job->jid, sig);
+    deletejob(jobs, -job->jid);
+}
+
+/*
+ * do_kill - Send a signal to processes or jobs:
+ *    kill [-s sig | -sig] pid|%jobid...
+ */
+int do_kill(char **argv)
+{
+    struct job_t *job;
+    int i = 1, sig = SIGTERM, status = 0, rc;
+    pid_t pid;
+
+    if (argv[1] && strcmp(argv[1], "-s") == 0 && argv[2]) {
+	sig = signame(argv[2]);
+	i = 3;
+    }
+    else if (argv[1] && argv[1][0] == '-' && argv[1][1]) {
+	sig = signame(argv[1]+1);
+	i = 2;
+    }
+    if (sig < 0 || argv[i] == NULL) {
+	printf("kill: usage: kill [-s sig | -sig] pid | %%jobid ...\n");
+	return 1;
+    }
+
+    for (; argv[i]; i++) {
+	if (argv[i][0] == '%') {
+	    if ((job = getjobjid(jobs, atoi(argv[i]+1))) == NULL) {
+		printf("%s: No such job\n", argv[i]);
+		status = 1;
+		continue;
+	    }
+	    if (job->pid == 0) {	/* never started: nothing to signal */
+		kill_queued(job, sig);
+		continue;
+	    }
+	    rc = signaljob(job, sig);
+	}
+	else if ((pid = atoi(argv[i])) == 0) {
+	    printf("kill: %s: arguments must be process or job IDs\n", argv[i]);
+	    status = 1;
+	    continue;
+	}
+	else
+	    rc = kill(pid, sig);
+	if (rc < 0) {
+	    printf("kill: (%s) - %s\n", argv[i], strerror(errno));
+	    status = 1;
+	}
+    }
+    return status;
+}
+
+/*
+ * do_wait - Wait for background jobs: wait [pid|%jobid...]. With no
+ *    arguments, wait until no job is running or queued in the background.
+ */
+int do_wait(char **argv)
+{
+    struct job_t *job;
+    int i, jid;
+
+    if (inchild)		/* a subshell has no jobs of its own */
+	return 0;
+    interrupted = 0;
+    if (argv[1] == NULL) {
+	while (jobcount[BG] + jobcount[QU] > 0 && !interrupted)
+	    loop_once(1);
+	return interrupted ? 130 : 0;
+    }
+    for (i = 1; argv[i]; i++) {
+	job = argv[i][0] == '%' ? getjobjid(jobs, atoi(argv[i]+1))
+				: getjobpid(jobs, atoi(argv[i]));
+	if (job == NULL)
+	    continue;
+	jid = job->jid;
+	while ((job = getjobjid(jobs, jid)) != NULL &&
+	       (job->state == BG || job->state == QU) && !interrupted)
+	    loop_once(1);
+    }
+    return interrupted ? 130 : 0;
+}
+
+/* do_true - Do nothing, successfully */
+int do_true(char **argv)
+{
+    return 0;
+}
+
+/* do_false - Do nothing, unsuccessfully */
+int do_false(char **argv)
+{
+    return 1;
+}
+
+/* sleep_done - Timer callback that ends do_sleep */
+static void sleep_done(void *arg)
+{
+    *(int *)arg = 1;
+}
+
+/*
+ * do_sleep - Pause for a (possibly fractional) number of seconds. The
+ *    event loop keeps running meanwhile, so jobs are still reaped and
+ *    ctrl-c cuts the sleep short.
+ */
+int do_sleep(char **argv)
+{
+    char *end;
+    double secs;
+    int id, done = 0;
+
+    if (argv[1] == NULL || (secs = strtod(argv[1], &end)) < 0 || *end) {
+	printf("sleep: usage: sleep seconds\n");
+	return 1;
+    }
+    if (inchild) {
+	struct timespec ts = { (time_t)secs, (long)((secs - (time_t)secs) * 1e9) };
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+	    ;
+	return 0;
+    }
+
+    interrupted = 0;
+    if ((id = loop_timer((int)(secs * 1000), sleep_done, &done)) < 0) {
+	printf("sleep: too many timers\n");
+	return 1;
+    }
+    while (!done && !interrupted)
+	loop_once(1);
+    loop_cancel(id);
+    return interrupted ? 130 : 0;
+}
+
+/*
+ * do_stats - Print the latency statistics; "-r" prints them in the
+ *    form -S writes, "-z" clears them.
+ */
+int do_stats(char **argv)
+{
+    if (argv[1] && strcmp(argv[1], "-z") == 0) {
+	memset(hists, 0, sizeof(hists));
+	nlaunches = nreaps = nsignals = nnotes = 0;
+	return 0;
+    }
+    stats_print(stdout, argv[1] && strcmp(argv[1], "-r") == 0);
+    return 0;
+}
+
+/* Halt policies for parallel */
+#define HALT_NEVER 0        /* run every input line */
+#define HALT_SOON  1        /* after a failure, start nothing new */
+#define HALT_NOW   2        /* after a failure, also kill what is running */
+
+struct pslot_t {            /* one command started by parallel */
+    pid_t pid;              /* its pid, 0 if it couldn't be started */
+    int fd;                 /* memfd holding its output */
+    int status;             /* its wait status, -1 while it runs */
+    int checked;            /* its status has been looked at */
+};
+
+/*
+ * parallel_arg - Substitute line for each {} in a template argument.
+ *    Returns a malloc'd string.
+ */
+static char *parallel_arg(char *tmpl, char *line)
+{
+    size_t n = strlen(tmpl) + 1, len = strlen(line);
+    char *p, *q, *arg;
+
+    for (p = tmpl; (p = strstr(p, "{}")) != NULL; p += 2)
+	n += len;
+    if ((arg = malloc(n)) == NULL)
+	unix_error("malloc error");
+    for (p = tmpl, q = arg; *p; ) {
+	if (p[0] == '{' && p[1] == '}') {
+	    memcpy(q, line, len);
+	    q += len;
+	    p += 2;
+	}
+	else
+	    *q++ = *p++;
+    }
+    *q = '\0';
+    return arg;
+}
+
+/* parallel_start - Launch the template for one input line as a job */
+static void parallel_start(char **tmpl, int ntmpl, char *line, int devnull,
+			   struct pslot_t *ps)
+{
+    char **argv, *cmdline;
+    struct launch_t l;
+    struct cglimit_t nolim = { 0, 0 };
+    int i, n = 0, subst = 0;
+    size_t len = 2;
+
+    if ((argv = malloc((ntmpl + 2) * sizeof(*argv))) == NULL)
+	unix_error("malloc error");
+    for (i = 0; i < ntmpl; i++) {
+	subst |= strstr(tmpl[i], "{}") != NULL;
+	argv[n++] = parallel_arg(tmpl[i], line);
+    }
+    if (!subst)			/* no {}: the line is the last argument */
+	argv[n++] = parallel_arg("{}", line);
+    argv[n] = NULL;
+
+    /* the job's command line, as jobs shows it */
+    for (i = 0; i < n; i++)
+	len += strlen(argv[i]) + 1;
+    if ((cmdline = malloc(len)) == NULL)
+	unix_error("malloc error");
+    for (i = 0, len = 0; i < n; i++)
+	len += sprintf(cmdline + len, "%s%s", i ? " " : "", argv[i]);
+    strcpy(cmdline + len, "\n");
+
+    if ((ps->fd = memfd_create("parallel", MFD_CLOEXEC)) < 0)
+	unix_error("memfd_create error");
+    l.argv = argv;
+    l.pgid = 0;
+    l.infd = devnull;
+    l.outfd = ps->fd;
+    l.errfd = -1;
+    l.closefd = -1;
+    l.nredirs = 0;
+    l.place = place_auto();	/* spread over the CPUs like other background jobs */
+    l.sched = NULL;
+    l.cg = cg_new(&nolim);	/* with -g */
+    l.envp = NULL;
+    ps->status = W_EXITCODE(127, 0);	/* in case it doesn't start */
+    ps->checked = 0;
+    if ((ps->pid = launch(&l)) != 0 && addjob(jobs, ps->pid, BG, cmdline)) {
+	ps->status = -1;
+	getjobinfo(getjobpid(jobs, ps->pid))->exitp = &ps->status;
+	getjobinfo(getjobpid(jobs, ps->pid))->place = l.place;
+	getjobinfo(getjobpid(jobs, ps->pid))->cg = l.cg;
+    }
+    else {
+	place_free(l.place);
+	cg_free(l.cg);
+    }
+    for (i = 0; i < n; i++)
+	free(argv[i]);
+    free(argv);
+    free(cmdline);
+}
+
+/* parallel_output - Copy a finished command's output to stdout */
+static void parallel_output(struct pslot_t *ps)
+{
+    copyout(ps->fd, 0, lseek(ps->fd, 0, SEEK_END));
+    close(ps->fd);
+}
+
+/*
+ * do_parallel - Run a command once per input line, n at a time:
+ *    parallel [-j n] [--halt never|soon|now] command [args] < file
+ *
+ * Each {} in the arguments becomes the line; without one the line is
+ * added as the last argument. Each command is a background job, so it
+ * is reaped and listed like any other, but its output is collected in
+ * a memfd and printed in input order once it and those before it are
+ * done. Input is read as the commands start, so it may be any length;
+ * it must be redirected, as the shell's own stdin holds its commands.
+ */
+int do_parallel(char **argv)
+{
+    struct pslot_t *ring;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    long head = 0, next = 0, k;
+    int i = 1, ntmpl, n, window, running, devnull, fd, eof = 0, stop = 0;
+    int halt = HALT_NEVER, failed = 0;
+    FILE *in;
+
+    n = maxrunning > 0 ? maxrunning : sysconf(_SC_NPROCESSORS_ONLN);
+    for (; argv[i] && argv[i][0] == '-'; i++) {
+	if (strcmp(argv[i], "-j") == 0 && argv[i+1] && (n = atoi(argv[i+1])) > 0)
+	    i++;
+	else if (strcmp(argv[i], "--halt") == 0 && argv[i+1]) {
+	    i++;
+	    if (strcmp(argv[i], "never") == 0)
+		halt = HALT_NEVER;
+	    else if (strcmp(argv[i], "soon") == 0)
+		halt = HALT_SOON;
+	    else if (strcmp(argv[i], "now") == 0)
+		halt = HALT_NOW;
+	    else
+		break;
+	}
+	else
+	    break;
+    }
+    for (ntmpl = 0; argv[i+ntmpl]; ntmpl++)
+	;
+    if (n <= 0 || ntmpl == 0 || !stdin_redirected || (argv[i][0] == '-')) {
+	printf("parallel: usage: parallel [-j n] [--halt never|soon|now] command [args] < file\n");
+	return 2;
+    }
+    if ((fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0)) < 0 ||
+	(in = fdopen(fd, "r")) == NULL)
+	unix_error("fdopen error");
+    if ((devnull = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+	unix_error("open error");
+
+    /* finished commands wait here until those before them are printed */
+    window = 2*n;
+    if ((ring = malloc(window * sizeof(*ring))) == NULL)
+	unix_error("malloc error");
+
+    interrupted = 0;
+    while (1) {
+	/* apply the halt policy as soon as any command fails */
+	for (k = head; k < next; k++) {
+	    struct pslot_t *ps = &ring[k % window];
+
+	    if (ps->status < 0 || ps->checked)
+		continue;
+	    ps->checked = 1;
+	    if (WIFEXITED(ps->status) && WEXITSTATUS(ps->status) == 0)
+		continue;
+	    failed++;
+	    if (halt != HALT_NEVER)
+		stop = 1;
+	    if (halt == HALT_NOW)
+		interrupted = 1;
+	}
+
+	/* print the output of finished commands, in input order */
+	while (head < next && ring[head % window].status >= 0)
+	    parallel_output(&ring[head++ % window]);
+
+	if (interrupted) {	/* ctrl-c or --halt now: kill what's running */
+	    stop = 1;
+	    for (k = head; k < next; k++)
+		if (ring[k % window].status < 0)
+		    signaljob(getjobpid(jobs, ring[k % window].pid), SIGTERM);
+	    interrupted = 0;
+	    failed += !halt;
+	}
+
+	/* keep n commands running */
+	for (running = 0, k = head; k < next; k++)
+	    running += ring[k % window].status < 0;
+	while (!eof && !stop && running < n && next - head < window) {
+	    if ((len = getline(&line, &cap, in)) < 0) {
+		eof = 1;
+		break;
+	    }
+	    if (len > 0 && line[len-1] == '\n')
+		line[len-1] = '\0';
+	    parallel_start(&argv[i], ntmpl, line, devnull, &ring[next % window]);
+	    running += ring[next++ % window].status < 0;
+	}
+	if (head == next && (eof || stop))
+	    break;
+	if (head < next)	/* wait for the oldest command */
+	    loop_once(1);
+    }
+
+    fflush(stdout);
+    free(line);
+    free(ring);
+    fclose(in);
+    close(devnull);
+    return failed > 101 ? 101 : failed;
+}
+/******************************
+ * End builtin command routines
+ ******************************/
+
+/******************************
+ * Command path cache routines
+ ******************************/
+
+/* pathhash - FNV-1a hash of a command name */
+static unsigned pathhash(const char *name)
+{
+    unsigned h = 2166136261u;
+
+    while (*name)
+	h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h % PATHBUCKETS;
+}
+
+/*
+ * path_setdirs - Split $PATH into pathdirs[] and start watching the
+ *    directories for changes: with inotify if we can, otherwise by
+ *    remembering their mtimes.
+ */
+static void path_setdirs(const char *val)
+{
+    struct stat st;
+    char *p, *dir;
+    size_t len = strlen(val);
+    int i;
+
+    free(pathval);
+    free(pathdirs);
+    free(pathmtime);
+    pathmtime = NULL;
+    if (inotifyfd >= 0) {
+	loop_unwatch(inotifyfd);
+	close(inotifyfd);
+    }
+
+    npathdirs = 1;
+    for (i = 0; val[i]; i++)
+	if (val[i] == ':')
+	    npathdirs++;
+    /* the directory strings live in the same block as pathdirs[] */
+    if ((pathval = strdup(val)) == NULL ||
+	(pathdirs = malloc(npathdirs * sizeof(*pathdirs) + len + 1)) == NULL)
+	unix_error("malloc error");
+    p = memcpy(pathdirs + npathdirs, val, len + 1);
+    for (i = 0; (dir = strsep(&p, ":")) != NULL; i++)
+	pathdirs[i] = *dir ? dir : ".";	/* empty entry means cwd */
+
+    inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyfd >= 0 && loop_watch(inotifyfd, EPOLLIN, path_ready, NULL) < 0) {
+	close(inotifyfd);
+	inotifyfd = -1;
+    }
+    if (inotifyfd >= 0) {
+	for (i = 0; i < npathdirs; i++)
+	    inotify_add_watch(inotifyfd, pathdirs[i], IN_CREATE | IN_DELETE |
+			      IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+			      IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    }
+    else {
+	if ((pathmtime = calloc(npathdirs, sizeof(*pathmtime))) == NULL)
+	    unix_error("calloc error");
+	for (i = 0; i < npathdirs; i++)
+	    if (stat(pathdirs[i], &st) == 0)
+		pathmtime[i] = st.st_mtim;
+    }
+}
+
+/*
+ * path_changed - Returns true if a PATH directory may have gained
+ *    commands since we last looked. Only needed before trusting a
+ *    negative entry: stale positive entries fail to spawn and are
+ *    retried.
+ */
+static int path_changed(void)
+{
+    char buf[4096];
+    struct stat st;
+    int i, changed = 0;
+
+    if (inotifyfd >= 0) {
+	while (read(inotifyfd, buf, sizeof(buf)) > 0)
+	    changed = 1;
+	return changed;
+    }
+    for (i = 0; i < npathdirs; i++) {
+	if (stat(pathdirs[i], &st) == 0 &&
+	    (st.st_mtim.tv_sec != pathmtime[i].tv_sec ||
+	     st.st_mtim.tv_nsec != pathmtime[i].tv_nsec)) {
+	    pathmtime[i] = st.st_mtim;
+	    changed = 1;
+	}
+    }
+    return changed;
+}
+
+/*
+ * path_search - Walk pathdirs[] for an executable called name. Returns
+ *    its path in a malloc'd buffer, or NULL.
+ */
+static char *path_search(const char *name)
+{
+    char *buf;
+    struct stat st;
+    size_t len, max = 0;
+    int i;
+
+    for (i = 0; i < npathdirs; i++)	/* one buffer fits every candidate */
+	if ((len = strlen(pathdirs[i])) > max)
+	    max = len;
+    if ((buf = malloc(max + strlen(name) + 2)) == NULL)
+	unix_error("malloc error");
+    for (i = 0; i < npathdirs; i++) {
+	sprintf(buf, "%s/%s", pathdirs[i], name);
+	if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && access(buf, X_OK) == 0)
+	    return buf;
+    }
+    free(buf);
+    return NULL;
+}
+
+/* path_find - Find the cache entry for name, or NULL */
+static struct pathent_t *path_find(const char *name)
+{
+    struct pathent_t *pe;
+
+    for (pe = pathtab[pathhash(name)]; pe; pe = pe->next)
+	if (strcmp(pe->name, name) == 0)
+	    return pe;
+    return NULL;
+}
+
+/* path_add - Add a cache entry mapping name to path (may be NULL) */
+static struct pathent_t *path_add(const char *name, char *path)
+{
+    struct pathent_t *pe;
+    unsigned h = pathhash(name);
+
+    if ((pe = calloc(1, sizeof(*pe))) == NULL || (pe->name = strdup(name)) == NULL)
+	unix_error("malloc error");
+    pe->path = path;
+    pe->next = pathtab[h];
+    pathtab[h] = pe;
+    return pe;
+}
+
+/*
+ * path_lookup - Resolve a command name through the cache. Returns the
+ *    entry (whose path is NULL if the command doesn't exist), or NULL
+ *    if the cache can't be used.
+ */
+struct pathent_t *path_lookup(char *name)
+{
+    struct pathent_t *pe;
+    char *val;
+
+    if (pathval == NULL || pathseen != pathgen) {	/* PATH was set */
+	if ((val = var_get("PATH")) == NULL)
+	    val = "/bin:/usr/bin";	/* execvp's default search path */
+	if (pathval == NULL || strcmp(val, pathval) != 0) {
+	    path_flush(0);
+	    path_setdirs(val);
+	}
+	pathseen = pathgen;
+    }
+
+    if ((pe = path_find(name)) != NULL) {
+	if (pe->path == NULL && path_changed()) {
+	    path_flush(0);
+	    pe = NULL;
+	}
+    }
+    if (pe == NULL)
+	pe = path_add(name, path_search(name));
+    pe->hits++;
+    return pe;
+}
+
+/* path_forget - Drop the cache entry for name */
+void path_forget(char *name)
+{
+    struct pathent_t **pp, *pe;
+
+    for (pp = &pathtab[pathhash(name)]; (pe = *pp) != NULL; pp = &pe->next) {
+	if (strcmp(pe->name, name) == 0) {
+	    *pp = pe->next;
+	    free(pe->name);
+	    free(pe->path);
+	    free(pe);
+	    return;
+	}
+    }
+}
+
+/* path_flush - Drop every cache entry, keeping pinned ones unless all */
+void path_flush(int all)
+{
+    struct pathent_t **pp, *pe;
+    int i;
+
+    for (i = 0; i < PATHBUCKETS; i++) {
+	pp = &pathtab[i];
+	while ((pe = *pp) != NULL) {
+	    if (pe->pinned && !all) {
+		pp = &pe->next;
+		continue;
+	    }
+	    *pp = pe->next;
+	    free(pe->name);
+	    free(pe->path);
+	    free(pe);
+	}
+    }
+}
+
+/* path_ready - A PATH directory changed: forget what we looked up */
+void path_ready(int fd, unsigned events, void *arg)
+{
+    if (path_changed())
+	path_flush(0);
+}
+
+/*
+ * do_hash - Execute the builtin hash command
+ *
+ *     hash                 list the cache
+ *     hash -r              forget every entry
+ *     hash -d name...      forget the given entries
+ *     hash -p path name    always run name from path
+ *     hash name...         look the names up and remember them
+ */
+int do_hash(char **argv)
+{
+    struct pathent_t *pe;
+    int i, status = 0;
+
+    if (argv[1] == NULL) {
+	printf("hits\tcommand\n");
+	for (i = 0; i < PATHBUCKETS; i++)
+	    for (pe = pathtab[i]; pe; pe = pe->next)
+		printf("%4d\t%s%s\n", pe->hits, pe->path ? pe->path : pe->name,
+		       pe->path ? (pe->pinned ? " (pinned)" : "") : " (not found)");
+    }
+    else if (strcmp(argv[1], "-r") == 0)
+	path_flush(1);
+    else if (strcmp(argv[1], "-d") == 0) {
+	for (i = 2; argv[i]; i++)
+	    path_forget(argv[i]);
+    }
+    else if (strcmp(argv[1], "-p") == 0) {
+	if (argv[2] == NULL || argv[3] == NULL) {
+	    printf("hash: usage: hash -p path name\n");
+	    return 1;
+	}
+	path_forget(argv[3]);
+	if ((pe = path_add(argv[3], strdup(argv[2]))) != NULL)
+	    pe->pinned = 1;
+    }
+    else {
+	for (i = 1; argv[i]; i++) {
+	    if (strchr(argv[i], '/'))
+		continue;
+	    if ((pe = path_lookup(argv[i]))->path == NULL) {
+		printf("hash: %s: not found\n", argv[i]);
+		status = 1;
+	    }
+	    else
+		pe->hits--;	/* looking it up isn't a use */
+	}
+    }
+    return status;
+}
+/**********************************
+ * End command path cache routines
+ **********************************/
+
+/********************************
+ * Pathname expansion routines
+ ********************************/
+
+/*
+ * strsort - Sort n strings byte by byte, with a three-way radix
+ *    quicksort (Bentley and Sedgewick's multikey quicksort) from byte
+ *    d on. Each byte is only looked at once per partition, so names
+ *    with long common prefixes cost no more than short ones.
+ */
+static void strsort(char **a, size_t n, size_t d)
+{
+    size_t lt, gt, i;
+    char *t;
+    int pivot, c;
+
+    while (n > 1) {
+	if (n < 8) {		/* insertion sort for the little ones */
+	    for (i = 1; i < n; i++)
+		for (lt = i; lt > 0 && strcmp(a[lt-1] + d, a[lt] + d) > 0; lt--)
+		    t = a[lt], a[lt] = a[lt-1], a[lt-1] = t;
+	    return;
+	}
+	t = a[n/2], a[n/2] = a[0], a[0] = t;
+	pivot = (unsigned char)a[0][d];
+	lt = 0, gt = n, i = 1;
+	while (i < gt) {	/* a[0..lt) < pivot, a[gt..n) > pivot */
+	    c = (unsigned char)a[i][d];
+	    if (c < pivot)
+		t = a[lt], a[lt++] = a[i], a[i++] = t;
+	    else if (c > pivot)
+		t = a[--gt], a[gt] = a[i], a[i] = t;
+	    else
+		i++;
+	}
+	strsort(a, lt, d);
+	strsort(a + gt, n - gt, d);
+	if (pivot == 0)		/* the equal ones are equal strings */
+	    return;
+	a += lt, n = gt - lt, d++;	/* the equal ones, on the next byte */
+    }
+}
+
+/*
+ * dirlist_read - Read the names in a directory with getdents64, a large
+ *    batch at a time, and sort them. "." and ".." are left out. Returns
+ *    NULL if it can't be read.
+ */
+static struct dirlist_t *dirlist_read(const char *path, struct stat *st)
+{
+    static char *dbuf;		/* getdents64 records */
+    struct dirlist_t *dl;
+    size_t len = 0, cap = 4096, k, nlen;
+    long n, off;
+    char *name;
+    int fd, i;
+
+    if ((fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+	return NULL;
+    if ((dbuf == NULL && (dbuf = malloc(65536)) == NULL) ||
+	(dl = calloc(1, sizeof(*dl))) == NULL || (dl->buf = malloc(cap)) == NULL ||
+	(dl->path = strdup(path)) == NULL)
+	unix_error("malloc error");
+
+    /* each name goes in buf as its d_type, the name and its NUL */
+    while ((n = syscall(SYS_getdents64, fd, dbuf, 65536)) > 0) {
+	for (off = 0; off < n; off += ((struct dirent64 *)(dbuf + off))->d_reclen) {
+	    struct dirent64 *de = (struct dirent64 *)(dbuf + off);
+
+	    name = de->d_name;
+	    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+		continue;
+	    nlen = strlen(name);
+	    if (len + nlen + 2 > cap) {
+		while (len + nlen + 2 > cap)
+		    cap *= 2;
+		if ((dl->buf = realloc(dl->buf, cap)) == NULL)
+		    unix_error("realloc error");
+	    }
+	    dl->buf[len] = de->d_type;
+	    memcpy(dl->buf + len + 1, name, nlen + 1);
+	    len += nlen + 2;
+	    dl->n++;
+	}
+    }
+    close(fd);
+    if (n < 0) {
+	free(dl->path);
+	free(dl->buf);
+	free(dl);
+	return NULL;
+    }
+
+    if ((dl->names = malloc((dl->n + 1) * sizeof(*dl->names))) == NULL)
+	unix_error("malloc error");
+    for (i = 0, k = 0; i < dl->n; i++) {
+	dl->names[i] = dl->buf + k + 1;
+	k += strlen(dl->names[i]) + 2;
+    }
+    strsort(dl->names, dl->n, 0);
+    dl->dev = st->st_dev;
+    dl->ino = st->st_ino;
+    dl->mtime = st->st_mtim;
+    return dl;
+}
+
+/* dirlist_free - Free a directory listing */
+static void dirlist_free(struct dirlist_t *dl)
+{
+    free(dl->path);
+    free(dl->names);
+    free(dl->buf);
+    free(dl);
+}
+
+/*
+ * dirlist_get - Return the sorted names in directory path ("" for the
+ *    current one), or NULL if it can't be read.
+ *
+ * The last DIRCACHE listings are kept, so a script that globs the same
+ * directory again doesn't read it again. One is reused while the
+ * directory's mtime, device and inode are unchanged, but only if it was
+ * read at least a second after that mtime: a file added in the same
+ * tick as the listing was read might not change the mtime, and a
+ * second covers coarse file system clocks too. A relative path is
+ * looked up again after cd, so it is cached by its absolute path.
+ */
+struct dirlist_t *dirlist_get(const char *path)
+{
+    struct dirlist_t *dl, **pp;
+    char key[PATH_MAX], cwd[PATH_MAX];
+    struct timespec now;
+    struct stat st;
+
+    if (path[0] != '/') {
+	if (getcwd(cwd, sizeof(cwd)) == NULL ||
+	    snprintf(key, sizeof(key), "%s/%s", cwd, path) >= (int)sizeof(key))
+	    return NULL;
+	path = key;
+    }
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+	return NULL;
+    for (pp = &dirlists; (dl = *pp) != NULL; pp = &dl->next) {
+	if (strcmp(dl->path, path) != 0)
+	    continue;
+	*pp = dl->next;		/* found: take it out, to reuse or drop */
+	ndirlists--;
+	if (dl->trusted && dl->dev == st.st_dev && dl->ino == st.st_ino &&
+	    dl->mtime.tv_sec == st.st_mtim.tv_sec &&
+	    dl->mtime.tv_nsec == st.st_mtim.tv_nsec)
+	    goto found;
+	dirlist_free(dl);
+	break;
+    }
+    if ((dl = dirlist_read(path, &st)) == NULL)
+	return NULL;
+    clock_gettime(CLOCK_REALTIME, &now);
+    dl->trusted = now.tv_sec - st.st_mtim.tv_sec > 1 ||
+	(now.tv_sec - st.st_mtim.tv_sec == 1 && now.tv_nsec >= st.st_mtim.tv_nsec);
+    if (ndirlists == DIRCACHE) {	/* drop the least recently used */
+	for (pp = &dirlists; (*pp)->next; pp = &(*pp)->next)
+	    ;
+	dirlist_free(*pp);
+	*pp = NULL;
+	ndirlists--;
+    }
+ found:
+    dl->next = dirlists;	/* most recently used goes first */
+    dirlists = dl;
+    ndirlists++;
+    return dl;
+}
+
+/* glob_push - Add a word to globv[] */
+void glob_push(char *word)
+{
+    if (nglobv == globcap) {
+	globcap = globcap ? 2 * globcap : 64;
+	if ((globv = realloc(globv, globcap * sizeof(*globv))) == NULL)
+	    unix_error("realloc error");
+    }
+    globv[nglobv++] = word;
+}
+
+/* glob_unmark - Turn parseline's glob marks in word back into *, ? and [ */
+char *glob_unmark(char *word)
+{
+    char *p;
+
+    for (p = word; *p; p++)
+	if (*p == GLOBSTAR || *p == GLOBONE || *p == GLOBSET)
+	    *p = *p == GLOBSTAR ? '*' : *p == GLOBONE ? '?' : '[';
+    return word;
+}
+
+/* glob_char - The character c stands for, inside a bracket expression */
+static int glob_char(char c)
+{
+    return c == GLOBSTAR ? '*' : c == GLOBONE ? '?' : c == GLOBSET ? '[' : (unsigned char)c;
+}
+
+/*
+ * glob_set - Match byte c against the bracket expression that starts
+ *    at p, just after its [. Sets *matched and returns where the
+ *    expression ends, or returns NULL if it has no ], and so is a
+ *    plain [.
+ */
+static const char *glob_set(const char *p, int c, int *matched)
+{
+    const char *start;
+    int neg, lo, hi, m = 0;
+
+    neg = *p == '!' || *p == '^';
+    start = p += neg;
+    for (; *p != ']' || p == start; p++) {	/* a ] first is itself */
+	if (*p == '\0' || *p == '/')
+	    return NULL;
+	lo = hi = glob_char(*p);
+	if (p[1] == '-' && p[2] && p[2] != ']')
+	    hi = glob_char(p[2]), p += 2;
+	if (lo <= c && c <= hi)
+	    m = 1;
+    }
+    *matched = m != neg;
+    return p + 1;
+}
+
+/*
+ * glob_match - True if name matches the pattern p, one path component
+ *    with parseline's glob marks in it. A * backs up to just one place,
+ *    the last * seen, which is all it takes to try every split.
+ */
+static int glob_match(const char *p, const char *name)
+{
+    const char *s = name, *star = NULL, *back = NULL, *q;
+    int m;
+
+    if (*s == '.' && *p != '.')	/* only a . matches a leading . */
+	return 0;
+    while (*s) {
+	if (*p == GLOBSTAR) {
+	    star = ++p;
+	    back = s;
+	    continue;
+	}
+	if (*p == GLOBONE) {
+	    p++, s++;
+	    continue;
+	}
+	if (*p == GLOBSET && (q = glob_set(p + 1, (unsigned char)*s, &m)) != NULL) {
+	    if (m) {
+		p = q, s++;
+		continue;
+	    }
+	}
+	else if (*p && (*p == *s || (*p == GLOBSET && *s == '['))) {
+	    p++, s++;
+	    continue;
+	}
+	if (star == NULL)
+	    return 0;
+	p = star;		/* let the last * take one more byte */
+	s = ++back;
+    }
+    while (*p == GLOBSTAR)
+	p++;
+    return *p == '\0';
+}
+
+/* glob_magic - True if path component p has a glob in it */
+static int glob_magic(const char *p)
+{
+    int m;
+
+    for (; *p; p++)
+	if (*p == GLOBSTAR || *p == GLOBONE ||
+	    (*p == GLOBSET && glob_set(p + 1, 0, &m) != NULL))
+	    return 1;
+    return 0;
+}
+
+/*
+ * glob_dir - Match the path components in pat against the directory
+ *    path (of length len, in a buffer of PATH_MAX), and push each file
+ *    name that matches them all onto globv[], in the arena.
+ */
+static void glob_dir(char *path, size_t len, char *pat)
+{
+    struct dirlist_t *dl;
+    char *comp, *rest, *name, **names;
+    size_t clen, nlen;
+    struct stat st;
+    int i, n, type;
+
+    while (*pat == '/') {	/* runs of / are kept as they are */
+	if (len + 1 >= PATH_MAX)
+	    return;
+	path[len++] = *pat++;
+    }
+    path[len] = '\0';
+    if (*pat == '\0') {	/* matched them all */
+	if (lstat(path, &st) == 0)
+	    glob_push(strcpy(arena_alloc(len + 1), path));
+	return;
+    }
+    clen = strcspn(pat, "/");
+    rest = pat + clen;
+    comp = memcpy(arena_alloc(clen + 1), pat, clen);
+    comp[clen] = '\0';
+
+    if (!glob_magic(comp)) {	/* a plain name: no need to list the directory */
+	glob_unmark(comp);
+	if (len + clen >= PATH_MAX)
+	    return;
+	memcpy(path + len, comp, clen + 1);
+	glob_dir(path, len + clen, rest);
+	return;
+    }
+    if ((dl = dirlist_get(path)) == NULL)
+	return;
+    if (*rest == '\0') {	/* the last one: push them as they match */
+	for (i = 0; i < dl->n; i++) {
+	    name = dl->names[i];
+	    if (glob_match(comp, name) && len + (nlen = strlen(name)) < PATH_MAX) {
+		memcpy(path + len, name, nlen + 1);
+		glob_push(strcpy(arena_alloc(len + nlen + 1), path));
+	    }
+	}
+	return;
+    }
+
+    /*
+     * Going further down reads other directories, which may push this
+     * listing out of the cache, so the ones that match are copied first.
+     */
+    names = arena_alloc((dl->n + 1) * sizeof(*names));
+    for (i = 0, n = 0; i < dl->n; i++) {
+	name = dl->names[i];
+	type = (unsigned char)name[-1];
+	if (type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN)
+	    continue;		/* only a directory can match more below it */
+	if (glob_match(comp, name))
+	    names[n++] = strcpy(arena_alloc(strlen(name) + 1), name);
+    }
+    for (i = 0; i < n; i++) {
+	if (len + (nlen = strlen(names[i])) >= PATH_MAX)
+	    continue;
+	memcpy(path + len, names[i], nlen + 1);
+	glob_dir(path, len + nlen, rest);
+    }
+}
+
+/*
+ * glob - Push the file names that match pattern, a word with
+ *    parseline's glob marks in it, onto globv[], sorted byte by byte.
+ *    Returns how many there were.
+ */
+int glob(char *pattern)
+{
+    char path[PATH_MAX];
+    size_t first = nglobv;
+
+    glob_dir(path, 0, pattern);
+    if (nglobv - first > 1 && strchr(pattern, '/') != NULL)
+	strsort(globv + first, nglobv - first, 0);	/* a listing is sorted already */
+    return nglobv - first;
+}
+
+/************************************
+ * End pathname expansion routines
+ ************************************/
+
+/*************************
+ * Shell variable routines
+ *************************/
+
+/* varhash - FNV-1a hash of a variable name of length len */
+static unsigned varhash(const char *name, size_t len)
+{
+    unsigned h = 2166136261u;
+
+    while (len-- > 0)
+	h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h % VARBUCKETS;
+}
+
+/*
+ * env_add - Export a variable: give its entry the next slot in envv[].
+ *    environ points at envv[], so the shell's own getenv sees it too.
+ */
+static void env_add(struct var_t *vp)
+{
+    if (nenv + 1 >= envcap) {
+	envcap = envcap ? 2 * envcap : 64;
+	if ((envv = realloc(envv, envcap * sizeof(*envv))) == NULL)
+	    unix_error("realloc error");
+	environ = envv;
+    }
+    vp->envi = nenv;
+    envv[nenv++] = vp->entry;
+    envv[nenv] = NULL;
+}
+
+/*
+ * env_remove - Take a variable's entry out of envv[], moving the last
+ *    entry into its slot
+ */
+static void env_remove(struct var_t *vp)
+{
+    char *last = envv[--nenv];
+
+    if (vp->envi < nenv) {
+	envv[vp->envi] = last;
+	var_find(last, strchr(last, '=') - last)->envi = vp->envi;
+    }
+    envv[nenv] = NULL;
+    vp->envi = -1;
+}
+
+/*
+ * var_init - Make a variable of each entry in the environment the shell
+ *    was started with, and export it again
+ */
+void var_init(void)
+{
+    char **e, *eq;
+
+    for (e = environ; e && *e; e++)
+	if ((eq = strchr(*e, '=')) != NULL && eq > *e)
+	    var_set(*e, eq - *e, eq + 1, 1);
+    if (envv == NULL) {		/* nothing exported: still give environ a NULL */
+	if ((envv = calloc(envcap = 64, sizeof(*envv))) == NULL)
+	    unix_error("calloc error");
+    }
+    environ = envv;
+}
+
+/* var_namelen - Length of the variable name that s starts with, 0 if none */
+int var_namelen(const char *s)
+{
+    int n = 0;
+
+    if (!isalpha((unsigned char)*s) && *s != '_')
+	return 0;
+    while (isalnum((unsigned char)s[n]) || s[n] == '_')
+	n++;
+    return n;
+}
+
+/* var_find - Find the variable whose name is the len bytes at name */
+struct var_t *var_find(const char *name, size_t len)
+{
+    struct var_t *vp;
+
+    for (vp = vartab[varhash(name, len)]; vp; vp = vp->next)
+	if (vp->namelen == len && memcmp(vp->entry, name, len) == 0)
+	    return vp;
+    return NULL;
+}
+
+/* var_get - Return the value of variable name, or NULL if it isn't set */
+char *var_get(const char *name)
+{
+    struct var_t *vp = var_find(name, strlen(name));
+
+    return vp ? vp->entry + vp->namelen + 1 : NULL;
+}
+
+/*
+ * var_set - Set the variable whose name is the len bytes at name, and
+ *    export it if export is true. An exported one stays exported.
+ *
+ * Only its own slot in envv[] changes, so launching a command never
+ * copies the environment: every child gets envv[] as it is.
+ */
+void var_set(const char *name, size_t len, const char *value, int export)
+{
+    struct var_t *vp;
+    size_t vlen = strlen(value);
+    char *entry;
+
+    if ((entry = malloc(len + vlen + 2)) == NULL)
+	unix_error("malloc error");
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, vlen + 1);
+
+    if ((vp = var_find(name, len)) == NULL) {
+	if ((vp = calloc(1, sizeof(*vp))) == NULL)
+	    unix_error("calloc error");
+	vp->namelen = len;
+	vp->envi = -1;
+	vp->next = vartab[varhash(name, len)];
+	vartab[varhash(name, len)] = vp;
+    }
+    free(vp->entry);		/* value may have been in it: copied already */
+    vp->entry = entry;
+    if (vp->envi >= 0)
+	envv[vp->envi] = entry;
+    else if (export)
+	env_add(vp);
+    if (len == 4 && memcmp(name, "PATH", 4) == 0)
+	pathgen++;
+}
+
+/* var_unset - Remove the variable whose name is the len bytes at name */
+void var_unset(const char *name, size_t len)
+{
+    struct var_t **pp, *vp;
+
+    for (pp = &vartab[varhash(name, len)]; (vp = *pp) != NULL; pp = &vp->next) {
+	if (vp->namelen == len && memcmp(vp->entry, name, len) == 0) {
+	    if (vp->envi >= 0)
+		env_remove(vp);
+	    *pp = vp->next;
+	    free(vp->entry);
+	    free(vp);
+	    break;
+	}
+    }
+    if (len == 4 && memcmp(name, "PATH", 4) == 0)
+	pathgen++;
+}
+
+/*
+ * var_env - Return the environment for a command with the n NAME=value
+ *    words in assigns[] in front of it: base (envv[], or the one a
+ *    queued job was queued with) with those in it too. It is allocated
+ *    in the command arena, unless there are none and it is base.
+ */
+char **var_env(char **base, char **assigns, int n)
+{
+    struct var_t *vp;
+    char **env;
+    int i, j, k, nbase;
+    size_t len;
+
+    if (n == 0)
+	return base;
+    for (nbase = 0; base[nbase]; nbase++)
+	;
+    env = arena_alloc((nbase + n + 1) * sizeof(*env));
+    memcpy(env, base, nbase * sizeof(*env));
+    for (i = 0, k = nbase; i < n; i++) {
+	len = strchr(assigns[i], '=') - assigns[i];
+	if (base == envv && (vp = var_find(assigns[i], len)) != NULL && vp->envi >= 0)
+	    j = vp->envi;	/* in place of the exported one */
+	else		/* in place of one of the same name, or after them */
+	    for (j = base == envv ? nenv : 0;
+		 j < k && strncmp(env[j], assigns[i], len + 1) != 0; j++)
+		;
+	env[j] = assigns[i];
+	if (j == k)
+	    k++;
+    }
+    env[k] = NULL;
+    return env;
+}
+
+/*
+ * do_export - Execute the builtin export command
+ *
+ *     export                   list the exported variables, sorted
+ *     export name[=value]...   export the variables, setting them first
+ *                              if there is a value
+ *
+ * A name that isn't set is left alone.
+ */
+int do_export(char **argv)
+{
+    struct var_t *vp;
+    char **env;
+    int i, n, status = 0;
+
+    if (argv[1] == NULL) {
+	env = arena_alloc((nenv + 1) * sizeof(*env));
+	memcpy(env, envv, (nenv + 1) * sizeof(*env));
+	strsort(env, nenv, 0);
+	for (i = 0; i < nenv; i++)
+	    printf("export %s\n", env[i]);
+	return 0;
+    }
+    for (i = 1; argv[i]; i++) {
+	n = var_namelen(argv[i]);
+	if (n == 0 || (argv[i][n] != '=' && argv[i][n] != '\0')) {
+	    printf("export: `%s': not a valid identifier\n", argv[i]);
+	    status = 1;
+	}
+	else if (argv[i][n] == '=')
+	    var_set(argv[i], n, argv[i] + n + 1, 1);
+	else if ((vp = var_find(argv[i], n)) != NULL && vp->envi < 0)
+	    env_add(vp);
+    }
+    return status;
+}
+
+/* do_unset - Execute the builtin unset command: unset name... */
+int do_unset(char **argv)
+{
+    int i, n, status = 0;
+
+    for (i = 1; argv[i]; i++) {
+	n = var_namelen(argv[i]);
+	if (n == 0 || argv[i][n] != '\0') {
+	    printf("unset: `%s': not a valid identifier\n", argv[i]);
+	    status = 1;
+	}
+	else
+	    var_unset(argv[i], n);
+    }
+    return status;
+}
+
+/*****************************
+ * End shell variable routines
+ *****************************/
+
+/*************************
+ * Output capture routines
+ *************************/
+
+/*
+ * ring_new - Make a ring for a job started with &!, with the pipe its
+ *    processes will write to. The caller passes ring->wfd to the
+ *    launch and then calls ring_start.
+ */
+struct ring_t *ring_new(void)
+{
+    struct ring_t *r;
+    int fds[2];
+
+    if ((r = malloc(sizeof(*r))) == NULL)
+	unix_error("malloc error");
+    if (pipe2(fds, O_CLOEXEC) < 0)
+	unix_error("pipe2 error");
+    if ((r->memfd = memfd_create("joblog", MFD_CLOEXEC)) < 0)
+	unix_error("memfd_create error");
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);	/* only our end */
+    r->fd = fds[0];
+    r->wfd = fds[1];
+    r->size = ringsize;
+    r->total = 0;
+    return r;
+}
+
+/* ring_start - Close our copy of the write end and start draining */
+void ring_start(struct ring_t *r)
+{
+    close(r->wfd);
+    r->wfd = -1;
+    if (loop_watch(r->fd, EPOLLIN, ring_ready, r) < 0)
+	unix_error("epoll_ctl error");
+}
+
+/*
+ * ring_ready - Move what the job wrote into its ring. splice moves the
+ *    pages from the pipe to the memfd without copying them through the
+ *    shell; the write offset wraps around at r->size, so the ring never
+ *    holds more than that however much the job writes.
+ */
+void ring_ready(int fd, unsigned events, void *arg)
+{
+    struct ring_t *r = arg;
+    char buf[8192];
+    loff_t off;
+    ssize_t n;
+
+    while (1) {
+	off = r->total % r->size;
+	n = splice(fd, NULL, r->memfd, &off, r->size - off,
+		   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n < 0 && errno == EINVAL) {	/* no splice: copy it */
+	    off = r->total % r->size;
+	    n = read(fd, buf, sizeof(buf) < r->size - off ? sizeof(buf) : r->size - off);
+	    if (n > 0 && pwrite(r->memfd, buf, n, off) != n)
+		n = -1;
+	}
+	if (n > 0)
+	    r->total += n;
+	else if (n < 0 && errno == EINTR)
+	    continue;
+	else if (n < 0 && errno == EAGAIN)
+	    return;
+	else
+	    break;
+    }
+
+    /* end of file: every process that had the pipe is gone */
+    loop_unwatch(fd);
+    close(fd);
+    r->fd = -1;
+}
+
+/* ring_free - Free a ring, closing its pipe if it is still open */
+void ring_free(struct ring_t *r)
+{
+    if (r == NULL)
+	return;
+    if (r->fd >= 0) {
+	loop_unwatch(r->fd);
+	close(r->fd);
+    }
+    if (r->wfd >= 0)
+	close(r->wfd);
+    close(r->memfd);
+    free(r);
+}
+
+/*
+ * copyout - Write bytes [off, end) of file fd to stdout, with sendfile
+ *    when stdout allows it
+ */
+void copyout(int fd, off_t off, off_t end)
+{
+    char buf[8192];
+    ssize_t n;
+
+    fflush(stdout);
+    while (off < end) {
+	if ((n = sendfile(STDOUT_FILENO, fd, &off, end - off)) > 0)
+	    continue;
+	if (n < 0 && errno == EINTR)
+	    continue;
+	/* stdout that sendfile can't write to */
+	while (off < end &&
+	       (n = pread(fd, buf, end - off < (off_t)sizeof(buf) ? end - off : (off_t)sizeof(buf), off)) > 0) {
+	    if (write(STDOUT_FILENO, buf, n) != n)
+		return;
+	    off += n;
+	}
+	return;
+    }
+}
+
+/* ring_print - Print what is in a ring, oldest byte first */
+void ring_print(struct ring_t *r)
+{
+    off_t head;
+
+    if (r->fd >= 0 && !inchild)	/* catch up first, if we own the ring */
+	ring_ready(r->fd, EPOLLIN, r);
+    head = r->total % r->size;
+    if (r->total > (long long)r->size) {
+	printf("[%lld earlier bytes dropped]\n", r->total - (long long)r->size);
+	copyout(r->memfd, head, r->size);
+    }
+    copyout(r->memfd, 0, head);
+}
+
+/*
+ * do_joblog - Print the output of a job started with &!: joblog
+ *    %jobid|pid. Jobs that have finished can still be looked at while
+ *    jobs -l lists them.
+ */
+int do_joblog(char **argv)
+{
+    struct ring_t *r = NULL;
+    struct job_t *job;
+    char *id = argv[1];
+    int i, jid = 0, found = 0;
+    pid_t pid = 0;
+
+    if (id == NULL || (id[0] == '%' ? (jid = atoi(id+1)) : (pid = atoi(id))) <= 0) {
+	printf("joblog: usage: joblog %%jobid|pid\n");
+	return 2;
+    }
+    if ((job = jid ? getjobjid(jobs, jid) : getjobpid(jobs, pid)) != NULL) {
+	found = 1;
+	r = getjobinfo(job)->ring;
+    }
+    else {
+	for (i = ndone-1; i >= 0 && i >= ndone-MAXDONE; i--) {
+	    struct donejob_t *d = &donejobs[i % MAXDONE];
+
+	    if (jid ? d->jid == jid : d->pid == pid) {
+		found = 1;	/* jids are reused: keep looking for a ring */
+		if ((r = d->ring) != NULL)
+		    break;
+	    }
+	}
+    }
+    if (!found) {
+	printf("%s: No such job\n", id);
+	return 1;
+    }
+    if (r == NULL) {
+	printf("%s: output not captured, start the job with &!\n", id);
+	return 1;
+    }
+    ring_print(r);
+    return 0;
+}
+/*****************************
+ * End output capture routines
+ *****************************/
+
+/******************
+ * Script routines
+ ******************/
+
+/* the words parseline gives by address, numbered for pword_t */
+static char *progops[] = {
+    OP_PIPE, OP_BG, OP_CAPTURE, OP_SEQ, OP_AND, OP_OR,
+    OP_IN, OP_OUT, OP_APPEND, OP_HERE, OP_DUPIN, OP_DUPOUT,
+    fdwords[0], fdwords[1], fdwords[2], fdwords[3], fdwords[4],
+    fdwords[5], fdwords[6], fdwords[7], fdwords[8], fdwords[9],
+};
+#define NPROGOPS (int)(sizeof(progops) / sizeof(progops[0]))
+
+/* script_hash - 64-bit FNV-1a hash of a script's text */
+static uint64_t script_hash(const char *p, size_t n)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (n-- > 0)
+	h = (h ^ (unsigned char)*p++) * 0x100000001b3ULL;
+    return h;
+}
+
+/* progbuf - A growable buffer that a program is built in */
+struct progbuf_t {
+    char *data;
+    size_t len, cap;
+};
+
+/* progbuf_put - Append n bytes to b, and return where they went */
+static uint32_t progbuf_put(struct progbuf_t *b, const void *p, size_t n)
+{
+    size_t off = b->len;
+
+    if (b->len + n > b->cap) {
+	b->cap = b->len + n > 2 * b->cap ? b->len + n : 2 * b->cap;
+	if ((b->data = realloc(b->data, b->cap)) == NULL)
+	    unix_error("realloc error");
+    }
+    memcpy(b->data + off, p, n);
+    b->len += n;
+    return off;
+}
+
+/*
+ * script_compile - Parse every line of a script once, into a program
+ *    that script_run can run without lexing it again. The program is
+ *    one malloc'd block that holds no pointers, so it can be written to
+ *    the cache as it is. Lines that don't parse keep only their text;
+ *    script_run hands them to eval, which reports the error in turn.
+ */
+struct proghdr_t *script_compile(const char *text, size_t len, uint64_t hash)
+{
+    struct progbuf_t lines = { 0 }, heap = { 0 };
+    struct proghdr_t *prog;
+    struct pline_t pl;
+    struct pword_t pw;
+    const char *p = text, *end = text + len, *nl, **src;
+    char *buf = NULL, **argv;
+    size_t n, bufcap = 0;
+    uint32_t i, j, nlines = 0;
+    static const char zero[4];
+
+    parsequiet = 1;
+    for (; p < end; p = nl + 1) {
+	if ((nl = memchr(p, '\n', end - p)) == NULL)
+	    nl = end;
+	n = nl - p;
+	if (n + 2 > bufcap) {
+	    bufcap = n + 2 > 2 * bufcap ? n + 2 : 2 * bufcap;
+	    if ((buf = realloc(buf, bufcap)) == NULL)
+		unix_error("realloc error");
+	}
+	memcpy(buf, p, n);
+	strcpy(buf + n, "\n");
+
+	pl.nwords = pl.words = 0;
+	if (n >= maxline)
+	    pl.bg = -2;
+	else if ((pl.bg = parseline(buf, &argv, &src)) >= 0 && argv[0] == NULL)
+	    continue;		/* blank or a comment */
+	pl.text = progbuf_put(&heap, buf, n + 2);
+	if (pl.bg >= 0) {
+	    for (pl.nwords = 0; argv[pl.nwords]; pl.nwords++)
+		;
+	    progbuf_put(&heap, zero, -heap.len & 3);	/* align the words */
+	    pl.words = heap.len;
+	    memset(&pw, 0, sizeof(pw));
+	    for (i = 0; i <= pl.nwords; i++)	/* room for them, before their strings */
+		progbuf_put(&heap, &pw, sizeof(pw));
+	    for (i = 0; i <= pl.nwords; i++) {
+		pw.src = src[i] - buf;
+		if (i == pl.nwords)
+		    pw.str = 0;
+		else {
+		    for (j = 0; j < NPROGOPS && argv[i] != progops[j]; j++)
+			;
+		    pw.str = j < NPROGOPS ? PW_OP | j :
+			progbuf_put(&heap, argv[i], strlen(argv[i]) + 1);
+		}
+		memcpy(heap.data + pl.words + i * sizeof(pw), &pw, sizeof(pw));
+	    }
+	}
+	progbuf_put(&lines, &pl, sizeof(pl));
+	nlines++;
+	arena_reset();
+    }
+    parsequiet = 0;
+    free(buf);
+
+    n = sizeof(*prog) + lines.len + heap.len;
+    if ((prog = malloc(n)) == NULL)
+	unix_error("malloc error");
+    prog->magic = PROGMAGIC;
+    prog->version = PROGVERSION;
+    prog->hash = hash;
+    prog->size = n;
+    prog->nlines = nlines;
+    if (lines.len)
+	memcpy(prog + 1, lines.data, lines.len);
+    if (heap.len)
+	memcpy((char *)(prog + 1) + lines.len, heap.data, heap.len);
+    free(lines.data);
+    free(heap.data);
+    return prog;
+}
+
+/* script_cachepath - Where the program for a script with hash h is kept */
+static void script_cachepath(char *path, size_t n, uint64_t h)
+{
+    snprintf(path, n, "%s/%016llx.tshc", scriptcache, (unsigned long long)h);
+}
+
+/*
+ * script_load - Map the cached program for a script with the given
+ *    hash, or return NULL if -C wasn't given or there is no good one.
+ *    The mapping stays until the shell exits.
+ */
+struct proghdr_t *script_load(uint64_t hash)
+{
+    char path[PATH_MAX];
+    struct proghdr_t *prog;
+    struct pline_t *pl;
+    struct pword_t *pw;
+    struct stat st;
+    size_t heaplen, textlen;
+    char *heap;
+    uint32_t i, j;
+    int fd;
+
+    if (scriptcache == NULL)
+	return NULL;
+    script_cachepath(path, sizeof(path), hash);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	return NULL;
+    prog = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*prog))
+	prog = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (prog == MAP_FAILED)
+	return NULL;
+
+    /* a program from another version, or a torn one, is recompiled */
+    if (prog->magic != PROGMAGIC || prog->version != PROGVERSION ||
+	prog->hash != hash || prog->size != st.st_size ||
+	prog->nlines > (st.st_size - sizeof(*prog)) / sizeof(*pl))
+	goto bad;
+    pl = (struct pline_t *)(prog + 1);
+    heaplen = st.st_size - sizeof(*prog) - prog->nlines * sizeof(*pl);
+    heap = (char *)(pl + prog->nlines);
+    if (heaplen == 0 || heap[heaplen - 1] != '\0')
+	goto bad;
+    for (i = 0; i < prog->nlines; i++) {
+	if (pl[i].text >= heaplen || pl[i].words % 4 != 0 ||
+	    pl[i].nwords >= heaplen / sizeof(struct pword_t) ||
+	    pl[i].words + (pl[i].nwords + 1) * sizeof(struct pword_t) > heaplen)
+	    goto bad;
+
+	/* every word is in the heap or an operator, and starts in the line */
+	textlen = strlen(heap + pl[i].text);	/* the heap ends in a NUL */
+	pw = (struct pword_t *)(heap + pl[i].words);
+	for (j = 0; j <= pl[i].nwords; j++, pw++)
+	    if (pw->src > textlen || (j < pl[i].nwords &&
+		(pw->str & PW_OP ? (pw->str & ~PW_OP) >= (uint32_t)NPROGOPS :
+		 pw->str >= heaplen)))
+		goto bad;
+    }
+    return prog;
+
+ bad:
+    munmap(prog, st.st_size);
+    return NULL;
+}
+
+/*
+ * script_save - Write a program to the -C directory, under a temporary
+ *    name that is then renamed, so a concurrent run never maps half of
+ *    it. It is only a cache: any failure is ignored.
+ */
+void script_save(struct proghdr_t *prog)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+    int fd, ok;
+
+    if (scriptcache == NULL)
+	return;
+    mkdir(scriptcache, 0777);
+    script_cachepath(path, sizeof(path), prog->hash);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
+	return;
+    ok = write(fd, prog, prog->size) == (ssize_t)prog->size;
+    close(fd);
+    if (!ok || rename(tmp, path) < 0)
+	unlink(tmp);
+}
+
+/*
+ * script_run - Run each line of a program in turn. Its words only need
+ *    pointing at, in the command arena, as eval would have left them.
+ */
+void script_run(struct proghdr_t *prog)
+{
+    struct pline_t *pl = (struct pline_t *)(prog + 1);
+    char *heap = (char *)(pl + prog->nlines), *text, **argv;
+    const char **src;
+    struct pword_t *pw;
+    uint32_t i, j;
+
+    for (i = 0; i < prog->nlines; i++, pl++) {
+	long long t0 = now_ns();
+	text = heap + pl->text;
+	if (pl->bg == -2) {
+	    printf("Command line too long\n");
+	    laststatus = 2;
+	}
+	else if (pl->bg < 0)	/* let parseline report the error */
+	    eval(text);
+	else {
+	    argv = arena_alloc((pl->nwords + 1) * sizeof(*argv));
+	    src = arena_alloc((pl->nwords + 1) * sizeof(*src));
+	    pw = (struct pword_t *)(heap + pl->words);
+	    for (j = 0; j <= pl->nwords; j++, pw++) {
+		argv[j] = j == pl->nwords ? NULL : pw->str & PW_OP ?
+		    progops[pw->str & ~PW_OP] : heap + pw->str;
+		src[j] = text + pw->src;
+	    }
+	    evallist(text, argv, src, pl->bg, t0);
+	}
+	arena_reset();
+	fflush(stdout);
+    }
+}
+
+/*
+ * runscript - Run the script at path instead of reading commands from
+ *    stdin, and exit with the status of its last command. The script is
+ *    mapped and hashed; with -C, a program compiled from the same text
+ *    by an earlier run is used as it is, so the script isn't parsed at
+ *    all.
+ */
+void runscript(char *path)
+{
+    struct proghdr_t *prog;
+    struct stat st;
+    char *text = "";
+    uint64_t hash;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+	printf("%s: %s\n", path, strerror(errno));
+	exit(127);
+    }
+    if (st.st_size > 0 &&
+	(text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	unix_error("mmap error");
+    close(fd);
+
+    hash = script_hash(text, st.st_size);
+    if ((prog = script_load(hash)) == NULL) {
+	prog = script_compile(text, st.st_size, hash);
+	script_save(prog);
+    }
+    if (st.st_size > 0)
+	munmap(text, st.st_size);
+    script_run(prog);
+    fflush(stdout);
+    exit(laststatus);
+}
+
+/*
+ * runcommand - Run the commands of -c and exit with the status of the
+ *    last one. If it is the only command and it runs in the foreground,
+ *    it is exec'd in place of the shell, as sh does: there is nothing
+ *    left to wait for it for.
+ */
+void runcommand(char *command)
+{
+    struct proghdr_t *prog = script_compile(command, strlen(command), 0);
+
+    execlast = prog->nlines == 1 && !verbose && statsfile == NULL;
+    script_run(prog);
+    fflush(stdout);
+    exit(laststatus);
+}
+
+/**********************
+ * End script routines
+ **********************/
+
+/*************************
+ * CPU placement routines
+ *************************/
+
+/*
+ * parsecpus - Parse a CPU list such as "0-3,8" into set. Returns 0,
+ *    or -1 if it isn't one.
+ */
+static int parsecpus(const char *s, cpu_set_t *set)
+{
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    do {
+	if (!isdigit((unsigned char)*s))
+	    return -1;
+	lo = hi = strtol(s, &end, 10);
+	if (*end == '-') {
+	    if (!isdigit((unsigned char)end[1]))
+		return -1;
+	    hi = strtol(end + 1, &end, 10);
+	}
+	if (lo > hi || hi >= CPU_SETSIZE)
+	    return -1;
+	for (; lo <= hi; lo++)
+	    CPU_SET(lo, set);
+	s = end + 1;
+    } while (*end == ',');
+    return *end == '\0' || *end == '\n' ? 0 : -1;
+}
+
+/*
+ * place_init - Read the CPUs the shell may run on, and the NUMA node
+ *    of each from sysfs, and deal them out into placeorder[] one node
+ *    at a time, so that consecutive picks alternate between nodes. It
+ *    runs when a job is first placed, so other shells don't pay for it.
+ */
+void place_init(void)
+{
+    char path[300], buf[4096];
+    struct dirent *de;
+    cpu_set_t set;
+    DIR *dir;
+    int fd, node, maxnode = 0, cpu, total, *next;
+    ssize_t n;
+
+    placeready = 1;
+    if (sched_getaffinity(0, sizeof(shellcpus), &shellcpus) < 0)
+	unix_error("sched_getaffinity error");
+    if ((dir = opendir("/sys/devices/system/node")) != NULL) {
+	while ((de = readdir(dir)) != NULL) {
+	    if (sscanf(de->d_name, "node%d", &node) != 1 ||
+		node < 0 || node >= CPU_SETSIZE)
+		continue;
+	    snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist",
+		     de->d_name);
+	    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		continue;
+	    n = read(fd, buf, sizeof(buf) - 1);
+	    close(fd);
+	    if (n <= 0)
+		continue;
+	    buf[n] = '\0';
+	    if (parsecpus(buf, &set) < 0)
+		continue;
+	    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &set))
+		    nodeof[cpu] = node;
+	    if (node > maxnode)
+		maxnode = node;
+	}
+	closedir(dir);
+    }
+
+    /* next[node] is where to look for that node's next CPU */
+    if ((next = calloc(maxnode + 1, sizeof(*next))) == NULL)
+	unix_error("calloc error");
+    total = CPU_COUNT(&shellcpus);
+    while (nplace < total) {
+	for (node = 0; node <= maxnode; node++) {
+	    for (cpu = next[node]; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &shellcpus) && nodeof[cpu] == node)
+		    break;
+	    next[node] = cpu + 1;
+	    if (cpu < CPU_SETSIZE)
+		placeorder[nplace++] = cpu;
+	}
+    }
+    free(next);
+}
+
+/* place_new - Make a placement; cpu is the CPU -a picked, or -1 */
+static struct place_t *place_new(int cpu, cpu_set_t *set, const char *text)
+{
+    struct place_t *p;
+
+    if ((p = malloc(sizeof(*p) + strlen(text) + 1)) == NULL)
+	unix_error("malloc error");
+    p->cpu = cpu;
+    p->set = *set;
+    strcpy(p->text, text);
+    if (cpu >= 0) {
+	cpuload[cpu]++;
+	nodeload[nodeof[cpu]]++;
+    }
+    return p;
+}
+
+/*
+ * place_prefix - If *argvp starts with "--cpus LIST" or "--cpus=LIST",
+ *    take it off and set *pp to a placement on those CPUs (the ones of
+ *    them the shell may use); otherwise set *pp to NULL. Returns -1
+ *    after printing a message if LIST is no good.
+ */
+int place_prefix(char ***argvp, struct place_t **pp)
+{
+    char **argv = *argvp, *list;
+    cpu_set_t set;
+
+    *pp = NULL;
+    if (argv[0] == NULL || strncmp(argv[0], "--cpus", 6) != 0)
+	return 0;
+    if (argv[0][6] == '=')
+	list = *argv++ + 7;
+    else if (argv[0][6] == '\0' && argv[1] != NULL)
+	list = argv[1], argv += 2;
+    else if (argv[0][6] == '\0') {
+	printf("--cpus: CPU list required\n");
+	return -1;
+    }
+    else
+	return 0;
+
+    if (!placeready)
+	place_init();
+    if (parsecpus(list, &set) < 0) {
+	printf("--cpus: %s: invalid CPU list\n", list);
+	return -1;
+    }
+    CPU_AND(&set, &set, &shellcpus);
+    if (CPU_COUNT(&set) == 0) {
+	printf("--cpus: %s: no usable CPU\n", list);
+	return -1;
+    }
+    *argvp = argv;
+    *pp = place_new(-1, &set, list);
+    return 0;
+}
+
+/*
+ * place_auto - Pick a CPU for a background job under the -a policy, or
+ *    return NULL if there is none. Round-robin takes the CPUs in
+ *    placeorder[]; least-loaded takes the one with the fewest placed
+ *    jobs, then on the least loaded node, from where round-robin is.
+ */
+struct place_t *place_auto(void)
+{
+    int i, k, a, b, best = -1;
+    char text[16];
+    cpu_set_t set;
+
+    if (placepolicy == PL_NONE)
+	return NULL;
+    if (!placeready)
+	place_init();
+    if (nplace == 0)
+	return NULL;
+    if (placepolicy == PL_RR)
+	best = placenext % nplace;
+    else {
+	for (k = 0; k < nplace; k++) {
+	    i = (placenext + k) % nplace;
+	    if (best >= 0) {
+		a = placeorder[i];
+		b = placeorder[best];
+		if (cpuload[a] > cpuload[b] || (cpuload[a] == cpuload[b] &&
+			nodeload[nodeof[a]] >= nodeload[nodeof[b]]))
+		    continue;
+	    }
+	    best = i;
+	}
+    }
+    placenext = best + 1;
+    CPU_ZERO(&set);
+    CPU_SET(placeorder[best], &set);
+    snprintf(text, sizeof(text), "%d", placeorder[best]);
+    return place_new(placeorder[best], &set, text);
+}
+
+/*
+ * foreach_thread - Call fn on every thread of process pid, or on just
+ *    pid if there is no /proc to list them
+ */
+static void foreach_thread(pid_t pid, void (*fn)(pid_t, void *), void *arg)
+{
+    struct dirent *de;
+    char path[64];
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    if ((dir = opendir(path)) == NULL) {
+	fn(pid, arg);
+	return;
+    }
+    while ((de = readdir(dir)) != NULL)
+	if (isdigit((unsigned char)de->d_name[0]))
+	    fn(atoi(de->d_name), arg);
+    closedir(dir);
+}
+
+/* foreach_task - Call fn on every thread of every live process of a job */
+static void foreach_task(struct job_t *job, void (*fn)(pid_t, void *), void *arg)
+{
+    struct jobinfo_t *ji = getjobinfo(job);
+    int i;
+
+    for (i = 0; i < ji->nprocs; i++)
+	if (!ji->procs[i].done)
+	    foreach_thread(ji->procs[i].pid, fn, arg);
+}
+
+/* place_task - Put one thread on the CPUs in the cpu_set_t at arg */
+static void place_task(pid_t tid, void *arg)
+{
+    sched_setaffinity(tid, sizeof(cpu_set_t), arg);
+}
+
+/*
+ * place_apply - Put every thread of every live process of a placed job
+ *    back on its CPUs. fg and bg do it before they continue the job, as
+ *    it may have moved itself, or started threads that did.
+ */
+void place_apply(struct job_t *job)
+{
+    struct jobinfo_t *ji = getjobinfo(job);
+
+    if (ji->place != NULL)
+	foreach_task(job, place_task, &ji->place->set);
+}
+
+/* place_free - Free a placement, and take its job off its CPU's load */
+void place_free(struct place_t *p)
+{
+    if (p == NULL)
+	return;
+    if (p->cpu >= 0) {
+	cpuload[p->cpu]--;
+	nodeload[nodeof[p->cpu]]--;
+    }
+    free(p);
+}
+
+/*****************************
+ * End CPU placement routines
+ *****************************/
+
+/****************************
+ * Scheduling class routines
+ ****************************/
+
+static struct { char *name; int policy; } policies[] = {
+    { "other", SCHED_OTHER },
+    { "batch", SCHED_BATCH },
+    { "idle",  SCHED_IDLE },
+};
+#define NPOLICIES (int)(sizeof(policies) / sizeof(policies[0]))
+
+char *ioclasses[] = { "none", "rt", "be", "idle" };	/* by IOPRIO_CLASS */
+#define IOPRIO_IDLE (3 << IOPRIO_CLASS_SHIFT)
+
+/*
+ * sched_opt - If *argvp starts with "--nice N", "--sched POLICY" or
+ *    "--io CLASS[:LEVEL]" (or one of them with =), take it off, set it
+ *    in sa and return 1. Returns 0 if it starts with none of them, and
+ *    -1 after printing a message if the value is no good.
+ */
+static int sched_opt(char ***argvp, struct schedattr_t *sa)
+{
+    static char *opts[] = { "--nice", "--sched", "--io" };
+    char **argv = *argvp, *val, *end;
+    size_t n;
+    long v;
+    int i, k;
+
+    if (argv[0] == NULL)
+	return 0;
+    for (k = 0; k < 3; k++) {
+	n = strlen(opts[k]);
+	if (strncmp(argv[0], opts[k], n) == 0 &&
+	    (argv[0][n] == '\0' || argv[0][n] == '='))
+	    break;
+    }
+    if (k == 3)
+	return 0;
+    if (argv[0][n] == '=')
+	val = *argv++ + n + 1;
+    else if (argv[1] != NULL)
+	val = argv[1], argv += 2;
+    else {
+	printf("%s: value required\n", opts[k]);
+	return -1;
+    }
+
+    switch (k) {
+    case 0:
+	v = strtol(val, &end, 10);
+	if (*val == '\0' || *end != '\0' || v < -20 || v > 19) {
+	    printf("--nice: %s: invalid nice value\n", val);
+	    return -1;
+	}
+	sa->nice = v;
+	sa->flags |= SA_NICE;
+	break;
+    case 1:
+	for (i = 0; i < NPOLICIES; i++)
+	    if (strcmp(val, policies[i].name) == 0)
+		break;
+	if (i == NPOLICIES) {
+	    printf("--sched: %s: invalid policy (other, batch or idle)\n", val);
+	    return -1;
+	}
+	sa->policy = policies[i].policy;
+	sa->flags |= SA_POLICY;
+	break;
+    case 2:
+	n = strcspn(val, ":");
+	for (i = 0; i < 4; i++)
+	    if (strlen(ioclasses[i]) == n && strncmp(val, ioclasses[i], n) == 0)
+		break;
+	v = 4;			/* the default level, as for ionice */
+	if (val[n] == ':')
+	    v = strtol(val + n + 1, &end, 10);
+	if (i == 4 || (val[n] == ':' && (val[n+1] == '\0' || *end != '\0')) ||
+	    v < 0 || v > 7) {
+	    printf("--io: %s: invalid I/O class (none, idle, be[:0-7] or rt[:0-7])\n", val);
+	    return -1;
+	}
+	sa->ioprio = i << IOPRIO_CLASS_SHIFT | (i == 1 || i == 2 ? v : 0);
+	sa->flags |= SA_IOPRIO;
+	break;
+    }
+    *argvp = argv;
+    return 1;
+}
+
+/*
+ * job_prefix - Take the "--cpus", "--nice", "--sched", "--io",
+ *    "--cpu-max" and "--mem-max" prefixes, in any order, off the front
+ *    of *argvp. Sets *pp as place_prefix does, the scheduling class in
+ *    sa and the cgroup limits in lim. Returns -1 after printing a
+ *    message if one of them is no good.
+ */
+int job_prefix(char ***argvp, struct place_t **pp, struct schedattr_t *sa,
+	       struct cglimit_t *lim)
+{
+    struct place_t *p;
+    int rc;
+
+    *pp = NULL;
+    sa->flags = 0;
+    lim->cpu = lim->mem = 0;
+    for (;;) {
+	if (place_prefix(argvp, &p) < 0)
+	    break;
+	if (p != NULL) {	/* the last --cpus wins */
+	    place_free(*pp);
+	    *pp = p;
+	    continue;
+	}
+	if ((rc = sched_opt(argvp, sa)) == 0)
+	    rc = cg_opt(argvp, lim);
+	if (rc < 0)
+	    break;
+	if (rc == 0)
+	    return 0;
+    }
+    place_free(*pp);
+    *pp = NULL;
+    return -1;
+}
+
+/*
+ * sched_set - Give thread tid (0: the calling one) the parts of sa that
+ *    are set. Returns -1 if any of them could not be set, with errno
+ *    from the first that failed.
+ */
+int sched_set(pid_t tid, struct schedattr_t *sa)
+{
+    struct sched_param sp = { 0 };
+    int rc = 0, err = 0;
+
+    if ((sa->flags & SA_NICE) && setpriority(PRIO_PROCESS, tid, sa->nice) < 0)
+	rc = -1, err = errno;
+    if ((sa->flags & SA_POLICY) && sched_setscheduler(tid, sa->policy, &sp) < 0 &&
+	rc == 0)
+	rc = -1, err = errno;
+    if ((sa->flags & SA_IOPRIO) &&
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, sa->ioprio) < 0 && rc == 0)
+	rc = -1, err = errno;
+    errno = err;
+    return rc;
+}
+
+/* sched_merge - Set the parts of sa that are set in *dst too */
+static void sched_merge(struct schedattr_t *dst, struct schedattr_t *sa)
+{
+    if (sa->flags & SA_NICE)
+	dst->nice = sa->nice;
+    if (sa->flags & SA_POLICY)
+	dst->policy = sa->policy;
+    if (sa->flags & SA_IOPRIO)
+	dst->ioprio = sa->ioprio;
+    dst->flags |= sa->flags;
+}
+
+/* sched_task - Give one thread the scheduling class at arg */
+static void sched_task(pid_t tid, void *arg)
+{
+    sched_set(tid, arg);
+}
+
+/* sched_apply - Give every thread of every live process of a job sa */
+void sched_apply(struct job_t *job, struct schedattr_t *sa)
+{
+    if (sa->flags)
+	foreach_task(job, sched_task, sa);
+}
+
+/*
+ * sched_bgfg - With -d, demote a job that bg sends to the background to
+ *    SCHED_BATCH (unless it is SCHED_IDLE) and idle I/O, and give one
+ *    that fg brings back its own class again. Its nice value is left
+ *    alone both ways, as the shell may not be allowed to lower it.
+ */
+void sched_bgfg(struct job_t *job, int bg)
+{
+    struct schedattr_t *own = &getjobinfo(job)->sched;
+    struct schedattr_t sa;
+
+    if (!demote)
+	return;
+    sa.flags = SA_POLICY | SA_IOPRIO;
+    sa.policy = (own->flags & SA_POLICY) ? own->policy : SCHED_OTHER;
+    sa.ioprio = (own->flags & SA_IOPRIO) ? own->ioprio : 0;
+    if (bg) {
+	if (sa.policy != SCHED_IDLE)
+	    sa.policy = SCHED_BATCH;
+	sa.ioprio = IOPRIO_IDLE;
+    }
+    sched_apply(job, &sa);
+}
+
+/*
+ * sched_text - Write the parts of sa that are set into buf, each
+ *    followed by a space, as listjobs and prio print them
+ */
+static char *sched_text(char *buf, size_t n, struct schedattr_t *sa)
+{
+    char *p = buf;
+    int i, c;
+
+    *p = '\0';
+    if (sa->flags & SA_NICE)
+	p += snprintf(p, n - (p - buf), "nice=%d ", sa->nice);
+    if (sa->flags & SA_POLICY) {
+	for (i = 0; i < NPOLICIES && policies[i].policy != sa->policy; i++)
+	    ;
+	p += snprintf(p, n - (p - buf), "sched=%s ",
+		      i < NPOLICIES ? policies[i].name : "rt");
+    }
+    if (sa->flags & SA_IOPRIO) {
+	c = (sa->ioprio >> IOPRIO_CLASS_SHIFT) & 3;
+	if (c == 1 || c == 2)
+	    snprintf(p, n - (p - buf), "io=%s:%d ", ioclasses[c],
+		     sa->ioprio & ((1 << IOPRIO_CLASS_SHIFT) - 1));
+	else
+	    snprintf(p, n - (p - buf), "io=%s ", ioclasses[c]);
+    }
+    return buf;
+}
+
+/*
+ * sched_get - Read the scheduling class process pid has now. A part
+ *    that can't be read is left out.
+ */
+static void sched_get(pid_t pid, struct schedattr_t *sa)
+{
+    long v;
+
+    sa->flags = 0;
+    errno = 0;
+    sa->nice = getpriority(PRIO_PROCESS, pid);
+    if (errno == 0)
+	sa->flags |= SA_NICE;
+    if ((sa->policy = sched_getscheduler(pid)) >= 0)
+	sa->flags |= SA_POLICY;
+    if ((v = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, pid)) >= 0) {
+	sa->ioprio = v;
+	sa->flags |= SA_IOPRIO;
+    }
+}
+
+/*
+ * do_prio - Show or change the scheduling class of jobs or processes:
+ *    prio [--nice N] [--sched POLICY] [--io CLASS[:LEVEL]] pid|%jobid...
+ *    A job keeps what it is given, for when it is queued, fg'd or bg'd.
+ */
+int do_prio(char **argv)
+{
+    struct schedattr_t sa, cur;
+    struct job_t *job;
+    char buf[64];
+    int rc, status = 0;
+    pid_t pid;
+
+    sa.flags = 0;
+    for (argv++; (rc = sched_opt(&argv, &sa)) != 0; )
+	if (rc < 0)
+	    return 1;
+    if (argv[0] == NULL) {
+	printf("prio: usage: prio [--nice N] [--sched other|batch|idle] "
+	       "[--io CLASS[:LEVEL]] pid | %%jobid ...\n");
+	return 1;
+    }
+
+    for (; *argv; argv++) {
+	job = NULL;
+	if (argv[0][0] == '%') {
+	    if ((job = getjobjid(jobs, atoi(argv[0]+1))) == NULL) {
+		printf("%s: No such job\n", argv[0]);
+		status = 1;
+		continue;
+	    }
+	    pid = job->pid;
+	}
+	else if ((pid = atoi(argv[0])) <= 0) {
+	    printf("prio: %s: arguments must be process or job IDs\n", argv[0]);
+	    status = 1;
+	    continue;
+	}
+	else
+	    job = getjobpid(jobs, pid);
+
+	if (sa.flags == 0) {	/* just show it */
+	    if (job && job->pid == 0)	/* not started yet */
+		cur = getjobinfo(job)->sched;
+	    else
+		sched_get(pid, &cur);
+	    sched_text(buf, sizeof(buf), &cur);
+	    if (*buf)		/* drop the trailing space */
+		buf[strlen(buf) - 1] = '\0';
+	    if (job)
+		printf("[%d] (%d) %s\n", job->jid, (int)pid, buf);
+	    else
+		printf("(%d) %s\n", (int)pid, buf);
+	    continue;
+	}
+	if ((job == NULL || job->pid != 0) && sched_set(pid, &sa) < 0 &&
+	    (job == NULL || errno != ESRCH)) {	/* a job's leader may be done */
+	    printf("prio: (%s) - %s\n", argv[0], strerror(errno));
+	    status = 1;
+	    continue;
+	}
+	if (job == NULL) {
+	    foreach_thread(pid, sched_task, &sa);
+	    continue;
+	}
+	sched_merge(&getjobinfo(job)->sched, &sa);
+	sched_apply(job, &sa);	/* nothing yet, if it's queued */
+    }
+    return status;
+}
+
+/***********************************
+ * End scheduling class routines
+ ***********************************/
+
+/******************
+ * cgroup routines
+ ******************/
+
+/*
+ * cg_write - Write the string val to the file name in cgroup directory
+ *    dir. Returns 0, or -1 with errno set.
+ */
+static int cg_write(const char *dir, const char *name, const char *val)
+{
+    char path[PATH_MAX];
+    int fd, rc;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+	return -1;
+    rc = write(fd, val, strlen(val)) < 0 ? -1 : 0;
+    close(fd);
+    return rc;
+}
+
+/*
+ * cg_read - Read the file name in cgroup directory dir into buf, as a
+ *    string. Returns its length, or -1.
+ */
+static int cg_read(const char *dir, const char *name, char *buf, size_t n)
+{
+    char path[PATH_MAX];
+    int fd, len;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	return -1;
+    len = read(fd, buf, n - 1);
+    close(fd);
+    if (len < 0)
+	return -1;
+    buf[len] = '\0';
+    return len;
+}
+
+/*
+ * cg_rmtree - Remove a shell's cgroup directory and the job cgroups in
+ *    it that are empty. Those of jobs still running are left, and so is
+ *    the directory then.
+ */
+static void cg_rmtree(const char *base)
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    DIR *dir;
+
+    if ((dir = opendir(base)) == NULL)
+	return;
+    while ((de = readdir(dir)) != NULL)
+	if (isdigit((unsigned char)de->d_name[0])) {
+	    snprintf(path, sizeof(path), "%s/%s", base, de->d_name);
+	    rmdir(path);
+	}
+    closedir(dir);
+    rmdir(base);
+}
+
+/*
+ * cg_init - Find the shell's own cgroup in the cgroup v2 hierarchy and
+ *    make a directory under it for the job cgroups. If there is no v2
+ *    hierarchy, or the shell can't write to its part of it, cgbase
+ *    stays NULL and jobs are stopped with signals as before.
+ */
+void cg_init(void)
+{
+    char line[PATH_MAX + 256], mnt[PATH_MAX], root[PATH_MAX], own[PATH_MAX];
+    char dirpath[PATH_MAX], path[PATH_MAX + 32], *rel = NULL;
+    struct dirent *de;
+    size_t n;
+    DIR *dir;
+    FILE *f;
+    int pid;
+
+    cgready = 1;
+    own[0] = '\0';
+    if ((f = fopen("/proc/self/cgroup", "re")) == NULL)
+	return;
+    while (fgets(line, sizeof(line), f))
+	if (strncmp(line, "0::", 3) == 0) {	/* the v2 entry */
+	    line[strcspn(line, "\n")] = '\0';
+	    if (snprintf(own, sizeof(own), "%s", line + 3) >= (int)sizeof(own))
+		own[0] = '\0';
+	}
+    fclose(f);
+    if (own[0] != '/' || (f = fopen("/proc/self/mountinfo", "re")) == NULL)
+	return;
+    while (rel == NULL && fgets(line, sizeof(line), f)) {
+	/* ID parent major:minor root mountpoint ... - type source opts */
+	if (strstr(line, " - cgroup2 ") == NULL ||
+	    sscanf(line, "%*d %*d %*s %4095s %4095s", root, mnt) != 2)
+	    continue;
+	n = strcmp(root, "/") == 0 ? 0 : strlen(root);
+	if (strncmp(own, root, n) == 0 && (own[n] == '/' || own[n] == '\0'))
+	    rel = own + n;
+    }
+    fclose(f);
+    if (rel == NULL)
+	return;
+
+    if (snprintf(dirpath, sizeof(dirpath), "%s%s", mnt,
+		 strcmp(rel, "/") == 0 ? "" : rel) >= (int)sizeof(dirpath) - 16)
+	return;
+
+    /* what shells that are gone left behind, with jobs that outlived them */
+    if ((dir = opendir(dirpath)) != NULL) {
+	while ((de = readdir(dir)) != NULL)
+	    if (sscanf(de->d_name, "tsh-%d", &pid) == 1 &&
+		kill(pid, 0) < 0 && errno == ESRCH &&
+		snprintf(path, sizeof(path), "%s/%s", dirpath, de->d_name) <
+		(int)sizeof(path))
+		cg_rmtree(path);
+	closedir(dir);
+    }
+    snprintf(path, sizeof(path), "%s/tsh-%d", dirpath, (int)getpid());
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+	if (verbose)
+	    printf("cgroup: %s: %s; stopping jobs with signals\n", path, strerror(errno));
+	return;
+    }
+    /* the controllers the limits need, where they can be had */
+    cg_write(dirpath, "cgroup.subtree_control", "+cpu");
+    cg_write(dirpath, "cgroup.subtree_control", "+memory");
+    cg_write(path, "cgroup.subtree_control", "+cpu");
+    cg_write(path, "cgroup.subtree_control", "+memory");
+    if ((cgbase = strdup(path)) == NULL)
+	unix_error("strdup error");
+    cgowner = getpid();
+    atexit(cg_cleanup);
+}
+
+/*
+ * cg_opt - If *argvp starts with "--cpu-max CPUS" or "--mem-max
+ *    BYTES[KMG]" (or one of them with =), take it off, set it in lim
+ *    and return 1. CPUS may be a fraction. Returns 0 if it starts with
+ *    neither, and -1 after printing a message if the value is no good.
+ */
+int cg_opt(char ***argvp, struct cglimit_t *lim)
+{
+    char **argv = *argvp, *opt, *val, *end;
+    double v;
+    size_t n;
+
+    if (argv[0] == NULL)
+	return 0;
+    if (strncmp(argv[0], "--cpu-max", 9) == 0)
+	opt = "--cpu-max";
+    else if (strncmp(argv[0], "--mem-max", 9) == 0)
+	opt = "--mem-max";
+    else
+	return 0;
+    n = 9;
+    if (argv[0][n] == '=')
+	val = *argv++ + n + 1;
+    else if (argv[0][n] != '\0')
+	return 0;
+    else if (argv[1] != NULL)
+	val = argv[1], argv += 2;
+    else {
+	printf("%s: value required\n", opt);
+	return -1;
+    }
+
+    v = strtod(val, &end);
+    if (opt[2] == 'm' && end != val && end[0] != '\0' && end[1] == '\0') {
+	switch (*end++) {
+	case 'K': case 'k': v *= 1024; break;
+	case 'M': case 'm': v *= 1024 * 1024; break;
+	case 'G': case 'g': v *= 1024 * 1024 * 1024; break;
+	default: end--;
+	}
+    }
+    if (end == val || *end != '\0' || !(v > 0) || v > (opt[2] == 'c' ? 1e6 : 1e15)) {
+	printf("%s: %s: invalid %s\n", opt, val,
+	       opt[2] == 'c' ? "number of CPUs" : "size");
+	return -1;
+    }
+    if (opt[2] == 'c')
+	lim->cpu = v * CG_PERIOD < 1000 ? 1000 : v * CG_PERIOD;	/* the kernel's least */
+    else
+	lim->mem = v;
+    *argvp = argv;
+    return 1;
+}
+
+/*
+ * cg_new - Make a cgroup for a new job, with the limits in lim. Returns
+ *    NULL if the job doesn't need one (no -g and no limits) or can't
+ *    have one; a job with limits then runs without them, after a
+ *    message.
+ */
+struct cgroup_t *cg_new(struct cglimit_t *lim)
+{
+    struct cgroup_t *cg;
+    char path[PATH_MAX], buf[64];
+    int len;
+
+    if (!cgjobs && lim->cpu == 0 && lim->mem == 0)
+	return NULL;
+    if (!cgready)
+	cg_init();
+    if (cgbase == NULL) {
+	if (lim->cpu || lim->mem)
+	    printf("cgroup: no writable cgroup v2 hierarchy; running without limits\n");
+	return NULL;
+    }
+    len = snprintf(path, sizeof(path), "%s/%ld", cgbase, ++cgseq);
+    if (mkdir(path, 0755) < 0) {
+	printf("cgroup: %s: %s\n", path, strerror(errno));
+	return NULL;
+    }
+    if ((cg = malloc(sizeof(*cg) + len + 1)) == NULL)
+	unix_error("malloc error");
+    strcpy(cg->path, path);
+    cg->frozen = 0;
+    strcat(path, "/cgroup.procs");
+    if ((cg->procsfd = open(path, O_WRONLY | O_CLOEXEC)) < 0) {
+	printf("cgroup: %s: %s\n", path, strerror(errno));
+	cg_free(cg);
+	return NULL;
+    }
+    if (lim->cpu) {
+	snprintf(buf, sizeof(buf), "%lld %d", lim->cpu, CG_PERIOD);
+	if (cg_write(cg->path, "cpu.max", buf) < 0)
+	    printf("--cpu-max: cannot set cpu.max: %s\n", strerror(errno));
+    }
+    if (lim->mem) {
+	snprintf(buf, sizeof(buf), "%lld", lim->mem);
+	if (cg_write(cg->path, "memory.max", buf) < 0)
+	    printf("--mem-max: cannot set memory.max: %s\n", strerror(errno));
+    }
+    return cg;
+}
+
+/* cg_join - Move process pid into cgroup cg */
+int cg_join(struct cgroup_t *cg, pid_t pid)
+{
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "%d", (int)pid);
+
+    return write(cg->procsfd, buf, len) < 0 ? -1 : 0;
+}
+
+/*
+ * cg_freeze - Freeze (frozen = 1) or thaw a job that has a cgroup.
+ *    Returns 0, or -1 if the job has no cgroup or it can't be done,
+ *    so the caller should fall back to SIGTSTP or SIGCONT.
+ *
+ * Freezing stops every process in the cgroup, including any that moved
+ * to a process group of their own, and none of them are told; so the
+ * shell sees no SIGCHLD for it and changes the job's state itself.
+ */
+int cg_freeze(struct job_t *job, int frozen)
+{
+    struct cgroup_t *cg = getjobinfo(job)->cg;
+
+    if (cg == NULL)
+	return -1;
+    if (cg->frozen == frozen)
+	return 0;
+    if (cg_write(cg->path, "cgroup.freeze", frozen ? "1" : "0") < 0)
+	return -1;
+    cg->frozen = frozen;
+    return 0;
+}
+
+/*
+ * cg_signal - Send sig to every process in cgroup cg. SIGKILL goes
+ *    through cgroup.kill where there is one. Returns 0 if it reached
+ *    at least one process, -1 otherwise.
+ */
+int cg_signal(struct cgroup_t *cg, int sig)
+{
+    char path[PATH_MAX];
+    int sent = 0;
+    long pid;
+    FILE *f;
+
+    if (sig == SIGKILL && cg_write(cg->path, "cgroup.kill", "1") == 0)
+	return 0;
+    snprintf(path, sizeof(path), "%s/cgroup.procs", cg->path);
+    if ((f = fopen(path, "re")) == NULL)
+	return -1;
+    while (fscanf(f, "%ld", &pid) == 1)
+	if (kill(pid, sig) == 0)
+	    sent++;
+    fclose(f);
+    return sent ? 0 : -1;
+}
+
+/*
+ * cg_account - Replace a finished job's CPU time with the cgroup's, and
+ *    its peak memory with memory.peak if the memory controller is on.
+ *    Unlike wait4's, they count processes the job never waited for.
+ */
+void cg_account(struct job_t *job)
+{
+    struct jobinfo_t *ji = getjobinfo(job);
+    char buf[1024], *p;
+
+    if (ji->cg == NULL)
+	return;
+    if (cg_read(ji->cg->path, "cpu.stat", buf, sizeof(buf)) > 0) {
+	if ((p = strstr(buf, "user_usec ")) != NULL)
+	    ji->usage.utime = atoll(p + 10);
+	if ((p = strstr(buf, "system_usec ")) != NULL)
+	    ji->usage.stime = atoll(p + 12);
+    }
+    if (cg_read(ji->cg->path, "memory.peak", buf, sizeof(buf)) > 0)
+	ji->usage.maxrss = atoll(buf) / 1024;
+}
+
+/*
+ * cg_free - Remove a job's cgroup. That fails while something the job
+ *    started is still in it; the directory is then left behind.
+ */
+void cg_free(struct cgroup_t *cg)
+{
+    if (cg == NULL)
+	return;
+    if (cg->procsfd >= 0)
+	close(cg->procsfd);
+    rmdir(cg->path);
+    free(cg);
+}
+
+/*
+ * cg_cleanup - When the shell exits, thaw its frozen jobs and hang them
+ *    up, as the kernel does for stopped jobs left without a shell, and
+ *    remove the cgroups that are empty by now.
+ */
+void cg_cleanup(void)
+{
+    int i;
+
+    if (getpid() != cgowner)	/* a child that called exit */
+	return;
+    for (i = 0; i < maxjobs; i++) {
+	if (jobs[i].state == UNDEF || jobinfo[i].cg == NULL)
+	    continue;
+	if (jobinfo[i].cg->frozen) {
+	    cg_freeze(&jobs[i], 0);
+	    cg_signal(jobinfo[i].cg, SIGHUP);
+	    cg_signal(jobinfo[i].cg, SIGCONT);
+	}
+	cg_free(jobinfo[i].cg);
+	jobinfo[i].cg = NULL;
+    }
+    cg_rmtree(cgbase);
+}
+
+/*********************
+ * End cgroup routines
+ *********************/
+
+/*************************
+ * Job scheduler routines
+ *************************/
+
+/*
+ * sched_full - True if another job can't start without going over the
+ *    -j limit. Running jobs, foreground or background, use a run slot;
+ *    stopped ones don't.
+ */
+int sched_full(void)
+{
+    if (maxrunning < 0)		/* default: one job per CPU, read on first use */
+	maxrunning = sysconf(_SC_NPROCESSORS_ONLN);
+    return maxrunning > 0 && jobcount[BG] + jobcount[FG] >= maxrunning;
+}
+
+/*
+ * queue_save - Keep what a job that is being queued will run: the words
+ *    of its prefixes, the nprefix at prefix, and of its stages, after
+ *    expand; the exported variables; and the working directory. Then
+ *    neither later commands nor the files there by the time it starts
+ *    change what it does.
+ */
+void queue_save(struct job_t *job, char **prefix, int nprefix,
+		struct launch_t *stages, int nstages, int bg)
+{
+    struct queued_t *q;
+    struct launch_t *sp;
+    struct redir_t *r;
+    char **words, **v, *p;
+    size_t n = nprefix + nstages, len = 0;
+    int i, j;
+
+    /* the stages as words parsepipe takes apart again */
+    for (sp = stages; sp < stages + nstages; sp++) {
+	for (i = 0; sp->argv[i]; i++)
+	    n++;
+	n += sp->nassigns + 3 * sp->nredirs;
+    }
+    words = v = arena_alloc(n * sizeof(*words));
+    for (i = 0; i < nprefix; i++)
+	*v++ = prefix[i];
+    for (sp = stages; sp < stages + nstages; sp++) {
+	if (sp > stages)
+	    *v++ = OP_PIPE;
+	for (i = 0; i < sp->nassigns; i++)
+	    *v++ = sp->assigns[i];
+	for (i = 0; sp->argv[i]; i++)
+	    *v++ = sp->argv[i];
+	for (i = 0, r = sp->redirs; i < sp->nredirs; i++, r++) {
+	    *v++ = fdwords[r->fd];
+	    *v++ = r->op;
+	    *v++ = r->word;
+	}
+    }
+    *v = NULL;
+
+    /* copy them, but for parseline's operators, which go by address */
+    for (v = words; *v; v++) {
+	for (j = 0; j < NPROGOPS && *v != progops[j]; j++)
+	    ;
+	if (j == NPROGOPS)
+	    len += strlen(*v) + 1;
+    }
+    if ((q = malloc(sizeof(*q) + n * sizeof(*q->argv) + len)) == NULL)
+	unix_error("malloc error");
+    q->argv = (char **)(q + 1);
+    p = (char *)(q->argv + n);
+    for (i = 0; words[i]; i++) {
+	for (j = 0; j < NPROGOPS && words[i] != progops[j]; j++)
+	    ;
+	q->argv[i] = j < NPROGOPS ? words[i] : p;
+	if (j == NPROGOPS)
+	    p = stpcpy(p, words[i]) + 1;
+    }
+    q->argv[i] = NULL;
+    for (i = nprefix, sp = stages; sp < stages + nstages; sp++) {
+	i += sp > stages;	/* the | */
+	for (j = 0; j < sp->nassigns; j++, i++)	/* marked for parsepipe again */
+	    q->argv[i][var_namelen(q->argv[i])] = ASSIGN;
+	for (j = 0; sp->argv[j]; j++)
+	    i++;
+	i += 3 * sp->nredirs;
+    }
+
+    for (i = 0, len = 0; i < nenv; i++)
+	len += strlen(envv[i]) + 1;
+    if ((q->envp = malloc((nenv + 1) * sizeof(*q->envp) + len)) == NULL)
+	unix_error("malloc error");
+    p = (char *)(q->envp + nenv + 1);
+    for (i = 0; i < nenv; i++) {
+	q->envp[i] = p;
+	p = stpcpy(p, envv[i]) + 1;
+    }
+    q->envp[nenv] = NULL;
+
+    q->bg = bg;
+    q->cwdfd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    getjobinfo(job)->queued = q;
+}
+
+/* queue_free - Free what queue_save kept */
+void queue_free(struct queued_t *q)
+{
+    if (q == NULL)
+	return;
+    if (q->cwdfd >= 0)
+	close(q->cwdfd);
+    free(q->envp);
+    free(q);
+}
+
+/*
+ * launchjob - Do startjob's work on the shell's fds as they are.
+ *
+ * It runs the words queue_save kept, in the environment and directory
+ * it was queued with; its prefixes and stages are split again here,
+ * into the command arena. That can happen from the event loop while a
+ * builtin still uses its argv, which is safe as the arena only grows
+ * until eval returns.
+ */
+static int launchjob(struct job_t *job, int state)
+{
+    struct queued_t *q = getjobinfo(job)->queued;
+    char **argv;
+    struct launch_t *stages;
+    struct ring_t *ring = NULL;
+    struct place_t *place;
+    struct schedattr_t sa;
+    struct cglimit_t lim;
+    struct cgroup_t *cg;
+    pid_t *pids;
+    int i, n, nstages, here, started;
+
+    for (n = 0; q->argv[n]; n++)
+	;
+    argv = arena_alloc((n + 1) * sizeof(*argv));
+    memcpy(argv, q->argv, (n + 1) * sizeof(*argv));
+    if (job_prefix(&argv, &place, &sa, &lim) < 0) {
+	deletejob(jobs, -job->jid);
+	return 0;
+    }
+    if ((stages = parsepipe(argv, &nstages)) == NULL) {
+	place_free(place);
+	deletejob(jobs, -job->jid);
+	return 0;
+    }
+    for (i = 0; i < nstages; i++)
+	stages[i].envp = var_env(q->envp, stages[i].assigns, stages[i].nassigns);
+    if (place == NULL && state == BG)
+	place = place_auto();
+    if (q->bg == 2)		/* started with &! */
+	ring = ring_new();
+    pids = arena_alloc(nstages * sizeof(*pids));
+    sched_merge(&sa, &getjobinfo(job)->sched);	/* prio while it was queued */
+    cg = cg_new(&lim);
+
+    /* redirections and relative names are looked up where it was queued */
+    if ((here = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) >= 0 &&
+	fchdir(q->cwdfd) < 0) {
+	close(here);
+	here = -1;
+    }
+    started = launch_pipeline(stages, nstages, pids, ring ? ring->wfd : -1,
+			      place, sa.flags ? &sa : NULL, cg);
+    if (here >= 0) {
+	if (fchdir(here) < 0)
+	    unix_error("fchdir error");
+	close(here);
+    }
+    if (started == 0) {
+	ring_free(ring);
+	place_free(place);
+	cg_free(cg);
+	deletejob(jobs, -job->jid);
+	return 0;
+    }
+    if (ring)
+	ring_start(ring);
+    queue_free(q);
+    getjobinfo(job)->queued = NULL;
+    getjobinfo(job)->ring = ring;
+    getjobinfo(job)->place = place;
+    getjobinfo(job)->sched = sa;
+    getjobinfo(job)->cg = cg;
+    for (i = 0; i < nstages; i++) {
+	if (pids[i] == 0)
+	    continue;
+	if (job->pid == 0)	/* the first stage that started leads the job */
+	    job->pid = pids[i];
+	addproc(jobs, job, pids[i]);
+    }
+    getjobinfo(job)->start = now_ns();
+    setjobstate(jobs, job, state);
+    if (state == BG)
+	printf("[%d] (%d) %s", job->jid, job->pid, getjobinfo(job)->cmd->text);
+    return 1;
+}
+
+/*
+ * startjob - Launch a queued job and put it in state. Returns 1 if any
+ *    of its processes started; otherwise the job is deleted.
+ *
+ * A job can come off the queue while a builtin such as wait runs with
+ * its redirections applied to the shell; it is launched, and its
+ * messages printed, on the fds they replaced.
  */
-
-void waitfg(pid_t pid)
+int startjob(struct job_t *job, int state)
 {
-  
-    struct job_t *p;
-    p = getjobpid(jobs,pid);	/* pinter to the entry in the job table of the job corresponding to pid */
-    while(p!=NULL&&(p->state==FG))	/* looping until the state is no longer FG */ 
-        {
-          sleep(1);	/* sleep for 1 sec after each check */
-          /*printf("Sleeping...")*/
-        }
-        return;
-   
-}
+    struct launch_t *lp = redirlp;
+    int started;
 
-/*****************
- * Signal handlers
- *****************/
+    if (lp)
+	redir_swap(lp, 0);
+    started = launchjob(job, state);
+    if (lp)
+	redir_swap(lp, 1);
+    return started;
+}
 
-/* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+/*
+ * sched_run - Start queued jobs, highest priority first and otherwise
+ *    in the order they were submitted, until the run slots are full
  */
-void sigchld_handler(int sig) 
+void sched_run(void)
 {
-	pid_t pid;
-	check_if_fg=0;
-	int jid;	/* jid of the job being considered */
-	int status;	/* status contains information about the status of the job that is stopped or terminated */
-	
-	/*
-	waitpid checks if any child process is terminated or stopped without pausing the parent process and will reap all its child processes.
-	*/
-	while((pid = waitpid(-1,&status,WNOHANG|WUNTRACED)) > 0) 
-	{		
-		
-		jid = pid2jid(pid);	/* obtain jid of the job from pid */
-		if(jobs[jid-1].state == FG) 	/* if the is in foreground state */
-			check_if_fg = 1;
+    int i, jid, best;
 
-		/* 	
-			WIFEXITED checks if the job terminated normally. It is then deleted from the joblist.
-		 */
-		if(WIFEXITED(status)) 
-		{
-			deletejob(jobs,pid);
-		}
+    while (jobcount[QU] > 0 && !sched_full()) {
+	best = -1;
+	for (jid = 1; jid < nextjid; jid++) {
+	    if ((i = jidmap[jid]) >= 0 && jobs[i].state == QU &&
+		(best < 0 || jobs[i].prio > jobs[best].prio))
+		best = i;
+	}
+	startjob(&jobs[best], BG);
+    }
+    fflush(stdout);
+}
+/*****************************
+ * End job scheduler routines
+ *****************************/
 
-		/*
-			WIFSTOPPED checks if the job is stopped on receiving a signal. The state of the job is then changed to ST
-		*/
-		
-		else if(WIFSTOPPED(status)) 
-		{			
-			getjobpid(jobs,pid)->state = ST;
-			printf("Job [%d] (%d) stopped by signal %d\n", jid, pid, SIGTSTP);
-		}
-		
-		/*
-			WIFSIGNALED checks if the job terminated on receiving a signal. It is then deleted from the joblist.
-		*/
-		else if(WIFSIGNALED(status)) 
-		{
-			if(WTERMSIG(status) == SIGINT)	/* termination due to SIGINT signal */		
-			{
-				deletejob(jobs,pid);	
-				printf("Job [%d] (%d) terminated by signal %d\n",jid,pid,SIGINT);		
-			}
-		}
+/***********************
+ * Statistics routines
+ ***********************/
 
-	}
-	return;
+char *phasenames[NPHASES] = {
+    "parse",			/* parseline and parsepipe */
+    "lookup",			/* PATH cache lookup */
+    "spawn",			/* posix_spawn or fork+exec, per process */
+    "builtin",			/* running a builtin in the shell */
+    "reap",			/* one pass of wait4 or waitid */
+    "notify",			/* reaped until the job list was updated */
+    "wakeup",			/* foreground job done until waitfg returned */
+};
+
+/*
+ * stat_record - Add one sample to a phase's histogram. This is called
+ *    on every hot path, so it is a handful of adds and no clock reads.
+ */
+void stat_record(int phase, long long ns)
+{
+    struct hist_t *h = &hists[phase];
+    int b = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+
+    if (b >= HISTBUCKETS)
+	b = HISTBUCKETS-1;
+    h->buckets[b]++;
+    h->count++;
+    h->sum += ns;
+    if (ns > h->max)
+	h->max = ns;
 }
 
-/* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenver the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.  
+/*
+ * percentile - Estimate the p'th percentile of a histogram: the upper
+ *    bound of the bucket it falls in, but no more than the maximum
  */
-void sigint_handler(int sig) 
+static long long percentile(struct hist_t *h, double p)
 {
-	pid_t pid = fgpid(jobs);	/* pid of foreground job */
-	/* 
-	SIGINT is sent to process group of the foreground job 
-	*/
-	if(kill(-pid, SIGINT) < 0)
-		unix_error("kill error\n"); 
+    long rank = (long)(p * h->count + 0.999999), seen = 0;
+    long long bound;
+    int b;
 
-	return;
+    if (rank < 1)
+	rank = 1;
+    for (b = 0; b < HISTBUCKETS; b++)
+	if ((seen += h->buckets[b]) >= rank)
+	    break;
+    bound = (2LL << b) - 1;
+    return bound < h->max ? bound : h->max;
+}
+
+/* fmtns - Format a latency in ns with a readable unit */
+static char *fmtns(char *buf, long long ns)
+{
+    if (ns < 10000)
+	sprintf(buf, "%lldns", ns);
+    else if (ns < 10000000)
+	sprintf(buf, "%.1fus", ns / 1e3);
+    else
+	sprintf(buf, "%.1fms", ns / 1e6);
+    return buf;
 }
 
 /*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.  
+ * stats_print - Print p50/p99/max of each phase and the counters. The
+ *    raw form has one "name key value..." line per phase or counter,
+ *    with times in ns, so it can be fed straight to a dashboard.
  */
-void sigtstp_handler(int sig) 
+void stats_print(FILE *fp, int raw)
 {
-	pid_t pid = fgpid(jobs);	/* pid of foreground job */
-        /* 
-	SIGTSTP is sent to process group of the foreground job 
-	*/
-	if(kill(-pid,SIGTSTP) < 0)
-		unix_error("kill error\n"); 
-	//jobs[pid2jid(pid)-1].state = ST;	/* state of job is changed to stopped */	
-	    
-	return;
+    char b1[32], b2[32], b3[32], b4[32];
+    struct hist_t *h;
+    int i;
+
+    if (!raw)
+	fprintf(fp, "%-8s %8s %9s %9s %9s %9s\n",
+		"phase", "count", "mean", "p50", "p99", "max");
+    for (i = 0; i < NPHASES; i++) {
+	h = &hists[i];
+	if (raw)
+	    fprintf(fp, "phase %s count %ld sum %lld p50 %lld p99 %lld max %lld\n",
+		    phasenames[i], h->count, h->sum, percentile(h, 0.50),
+		    percentile(h, 0.99), h->max);
+	else if (h->count > 0)
+	    fprintf(fp, "%-8s %8ld %9s %9s %9s %9s\n", phasenames[i], h->count,
+		    fmtns(b1, h->sum / h->count), fmtns(b2, percentile(h, 0.50)),
+		    fmtns(b3, percentile(h, 0.99)), fmtns(b4, h->max));
+    }
+    if (raw)
+	fprintf(fp, "counter launches %ld\ncounter reaps %ld\n"
+		"counter signals %ld\ncounter notes %ld\n",
+		nlaunches, nreaps, nsignals, nnotes);
+    else
+	fprintf(fp, "launches %ld, reaps %ld, signals forwarded %ld, notes %ld\n",
+		nlaunches, nreaps, nsignals, nnotes);
 }
 
-/*********************
- * End signal handlers
- *********************/
+/* stats_dump - Append the raw statistics to the -S file at exit */
+void stats_dump(void)
+{
+    FILE *fp;
+
+    if (inchild)
+	return;
+    if ((fp = fopen(statsfile, "a")) == NULL) {
+	fprintf(stderr, "%s: %s\n", statsfile, strerror(errno));
+	return;
+    }
+    fprintf(fp, "pid %d\n", getpid());
+    stats_print(fp, 1);
+    fclose(fp);
+}
+/***************************
+ * End statistics routines
+ ***************************/
 
 /***********************************************
  * Helper routines that manipulate the job list
@@ -561,150 +5938,555 @@ void sigtstp_handler(int sig)
 
 /* clearjob - Clear the entries in a job struct */
 void clearjob(struct job_t *job) {
+    struct jobinfo_t *ji = getjobinfo(job);
+
     job->pid = 0;
     job->jid = 0;
     job->state = UNDEF;
-    job->cmdline[0] = '\0';
+    ji->nprocs = 0;
+    ji->nlive = 0;
+    free(ji->procs);
+    ji->procs = NULL;
+    if (ji->cmd)
+	cmdstr_put(ji->cmd);
+    ji->cmd = NULL;
+    ring_free(ji->ring);
+    ji->ring = NULL;
+    place_free(ji->place);
+    ji->place = NULL;
+    ji->sched.flags = 0;
+    cg_free(ji->cg);
+    ji->cg = NULL;
+    queue_free(ji->queued);
+    ji->queued = NULL;
+}
+
+/* getjobinfo - Return the rest of a job */
+struct jobinfo_t *getjobinfo(struct job_t *job) {
+    return &jobinfo[job - jobs];
+}
+
+/*
+ * cmdstr_new - Put a command line in the string store, with one
+ *    reference. Returns NULL if out of memory.
+ */
+struct cmdstr_t *cmdstr_new(const char *text) {
+    size_t len = strlen(text);
+    struct cmdstr_t *c;
+
+    if ((c = malloc(sizeof(*c) + len + 1)) == NULL)
+	return NULL;
+    c->refs = 1;
+    c->len = len;
+    memcpy(c->text, text, len + 1);
+    return c;
+}
+
+/* cmdstr_put - Drop a reference to a command line, freeing it with the last */
+void cmdstr_put(struct cmdstr_t *c) {
+    if (--c->refs == 0)
+	free(c);
 }
 
 /* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
+void initjobs(void) {
     int i;
 
-    for (i = 0; i < MAXJOBS; i++)
+    maxjobs = MAXJOBS;
+    jidcap = MAXJOBS;
+    pidcap = 2*MAXJOBS;
+    if ((jobs = calloc(maxjobs, sizeof(*jobs))) == NULL ||
+	(jobinfo = calloc(maxjobs, sizeof(*jobinfo))) == NULL ||
+	(jidmap = malloc(jidcap * sizeof(*jidmap))) == NULL ||
+	(pidhash = calloc(pidcap, sizeof(*pidhash))) == NULL)
+	unix_error("malloc error");
+
+    for (i = maxjobs-1; i >= 0; i--) {
 	clearjob(&jobs[i]);
+	jobs[i].next = freejob;
+	freejob = i;
+    }
+    for (i = 0; i < jidcap; i++)
+	jidmap[i] = -1;
 }
 
 /* maxjid - Returns largest allocated job ID */
 int maxjid(struct job_t *jobs) 
 {
-    int i, max=0;
+    return nextjid-1;
+}
+
+/* pidbucket - Home bucket of pid in pidhash[] */
+static inline int pidbucket(pid_t pid)
+{
+    return (int)(((unsigned)pid * 2654435761u) & (pidcap-1));
+}
+
+/* pidhash_find - Returns the bucket holding pid, or -1 */
+static int pidhash_find(pid_t pid)
+{
+    int b;
+
+    for (b = pidbucket(pid); pidhash[b].pid; b = (b+1) & (pidcap-1))
+	if (pidhash[b].pid == pid)
+	    return b;
+    return -1;
+}
+
+/* pidhash_insert - Record that process pid belongs to the job in slot */
+static void pidhash_insert(pid_t pid, int slot)
+{
+    int b;
+
+    if (2*(npids+1) > pidcap) {	/* keep the load factor under 1/2 */
+	struct pident_t *old = pidhash;
+	int i, oldcap = pidcap;
+
+	pidcap *= 2;
+	if ((pidhash = calloc(pidcap, sizeof(*pidhash))) == NULL)
+	    unix_error("calloc error");
+	for (i = 0; i < oldcap; i++) {
+	    if (old[i].pid) {
+		for (b = pidbucket(old[i].pid); pidhash[b].pid; b = (b+1) & (pidcap-1))
+		    ;
+		pidhash[b] = old[i];
+	    }
+	}
+	free(old);
+    }
+    for (b = pidbucket(pid); pidhash[b].pid; b = (b+1) & (pidcap-1))
+	;
+    pidhash[b].pid = pid;
+    pidhash[b].slot = slot;
+    npids++;
+}
+
+/* 
+ * pidhash_remove - Remove the entry in bucket b, shifting later
+ *    entries of the same probe run back so lookups need no tombstones
+ */
+static void pidhash_remove(int b)
+{
+    int i, home;
+
+    pidhash[b].pid = 0;
+    npids--;
+    for (i = (b+1) & (pidcap-1); pidhash[i].pid; i = (i+1) & (pidcap-1)) {
+	home = pidbucket(pidhash[i].pid);
+	/* move entry i into the hole unless its home lies in (b, i] */
+	if ((i > b) ? (home <= b || home > i) : (home <= b && home > i)) {
+	    pidhash[b] = pidhash[i];
+	    pidhash[i].pid = 0;
+	    b = i;
+	}
+    }
+}
+
+/* growjobs - Double the job list, returning its new address or NULL */
+static struct job_t *growjobs(void)
+{
+    int i, n = 2*maxjobs;
+    struct job_t *p;
+    struct jobinfo_t *q;
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid > max)
-	    max = jobs[i].jid;
-    return max;
+    if ((q = realloc(jobinfo, n * sizeof(*jobinfo))) == NULL)
+	return NULL;
+    jobinfo = q;
+    memset(&jobinfo[maxjobs], 0, (n - maxjobs) * sizeof(*jobinfo));
+    if ((p = realloc(jobs, n * sizeof(*jobs))) == NULL)
+	return NULL;
+    jobs = p;
+    for (i = n-1; i >= maxjobs; i--) {
+	clearjob(&jobs[i]);
+	jobs[i].next = freejob;
+	freejob = i;
+    }
+    maxjobs = n;
+    return jobs;
 }
 
-/* addjob - Add a job to the job list */
+/* addjob - Add a job to the job list; a QU job has no pid until it starts */
 int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
 {
     int i;
+    struct cmdstr_t *cmd;
     
-    if (pid < 1)
+    if (pid < 1 && state != QU)
 	return 0;
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == 0) {
-	    jobs[i].pid = pid;
-	    jobs[i].state = state;
-	    jobs[i].jid = nextjid++;
-	    if (nextjid > MAXJOBS)
-		nextjid = 1;
-	    strcpy(jobs[i].cmdline, cmdline);
-  	    if(verbose){
-	        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
-	}
-    }
-    printf("Tried to create too many jobs\n");
-    return 0;
+    if (freejob < 0 && (jobs = growjobs()) == NULL) {
+	printf("Tried to create too many jobs\n");
+	return 0;
+    }
+    if (nextjid >= jidcap) {
+	int n = 2*jidcap, *p;
+
+	if ((p = realloc(jidmap, n * sizeof(*jidmap))) == NULL) {
+	    printf("Tried to create too many jobs\n");
+	    return 0;
+	}
+	for (i = jidcap; i < n; i++)
+	    p[i] = -1;
+	jidmap = p;
+	jidcap = n;
+    }
+    if ((cmd = cmdstr_new(cmdline)) == NULL) {
+	printf("Tried to create too many jobs\n");
+	return 0;
+    }
+
+    i = freejob;
+    freejob = jobs[i].next;
+    jobs[i].pid = pid;
+    jobs[i].state = state;
+    jobs[i].jid = nextjid++;
+    jobs[i].prio = 0;
+    jobinfo[i].exitp = NULL;
+    jobinfo[i].start = now_ns();
+    memset(&jobinfo[i].usage, 0, sizeof(jobinfo[i].usage));
+    jobinfo[i].cmd = cmd;
+    jidmap[jobs[i].jid] = i;
+    jobcount[state]++;
+    if (state == FG)
+	fgjob = i;
+    if (pid > 0)
+	addproc(jobs, &jobs[i], pid);
+    if(verbose){
+        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, cmd->text);
+    }
+    return 1;
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) 
+/* addproc - Add process pid (a pipeline stage) to a job */
+int addproc(struct job_t *jobs, struct job_t *job, pid_t pid)
 {
-    int i;
+    struct jobinfo_t *ji = getjobinfo(job);
+    struct proc_t *p;
 
-    if (pid < 1)
+    if ((p = realloc(ji->procs, (ji->nprocs+1) * sizeof(*p))) == NULL) {
+	kill(pid, SIGKILL);	/* nothing would reap it */
+	waitpid(pid, NULL, 0);
 	return 0;
+    }
+    ji->procs = p;
+    p += ji->nprocs++;
+    p->pid = pid;
+    p->pidfd = -1;
+    p->done = 0;
+    p->status = 0;
+    ji->nlive++;
+    pidhash_insert(pid, job - jobs);
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == pid) {
-	    clearjob(&jobs[i]);
-	    nextjid = maxjid(jobs)+1;
-	    return 1;
+    /* the child can't have been reaped yet, so its pid is still ours */
+    if (usepidfd) {
+	if ((p->pidfd = pidfd_open(pid, 0)) < 0 ||
+	    loop_watch(p->pidfd, EPOLLIN, pidfd_ready, NULL) < 0) {
+	    if (p->pidfd >= 0)
+		close(p->pidfd);
+	    p->pidfd = -1;
+	    usepidfd = 0;	/* fall back to reaping with waitpid(-1) */
+	    if (verbose)	/* e.g. EMFILE, with a pidfd per live process */
+		printf("pidfd: (%d) - %s; reaping with waitpid from now on\n",
+		       (int)pid, strerror(errno));
 	}
     }
-    return 0;
+    return 1;
+}
+
+/*
+ * deletejob - Delete the job containing process pid from the job list.
+ *    A job that hasn't started has no processes, so pid is minus its
+ *    jid instead.
+ */
+int deletejob(struct job_t *jobs, pid_t pid) 
+{
+    int b, i, k;
+    struct proc_t *p;
+
+    if (pid < 0 && -pid < jidcap && jidmap[-pid] >= 0 &&
+	jobs[jidmap[-pid]].pid == 0)
+	i = jidmap[-pid];
+    else if (pid < 1 || (b = pidhash_find(pid)) < 0)
+	return 0;
+    else
+	i = pidhash[b].slot;
+    for (k = 0, p = jobinfo[i].procs; k < jobinfo[i].nprocs; k++, p++) {
+	if ((b = pidhash_find(p->pid)) >= 0)
+	    pidhash_remove(b);
+	if (p->pidfd >= 0) {
+	    loop_unwatch(p->pidfd);
+	    close(p->pidfd);
+	}
+    }
+    jidmap[jobs[i].jid] = -1;
+    jobcount[jobs[i].state]--;
+    if (fgjob == i)
+	fgjob = -1;
+    clearjob(&jobs[i]);
+    jobs[i].next = freejob;
+    freejob = i;
+
+    /* the next jid is one past the largest one still in use */
+    while (nextjid > 1 && jidmap[nextjid-1] < 0)
+	nextjid--;
+    return 1;
+}
+
+/* setjobstate - Change the state of a job, tracking the foreground job */
+void setjobstate(struct job_t *jobs, struct job_t *job, int state)
+{
+    int i = job - jobs;
+
+    if (fgjob == i)
+	fgjob = -1;
+    if (state == FG)
+	fgjob = i;
+    jobcount[job->state]--;
+    jobcount[state]++;
+    job->state = state;
+}
+
+/*
+ * signaljob - Send sig to every process in a job. Returns 0 if it
+ *    reached at least one process, -1 otherwise.
+ *
+ * While the leader is unreaped its pid, and so the process group ID,
+ * can't be reused, and signalling the group also reaches processes the
+ * job forked itself. Once the leader is gone, only the processes we
+ * still hold pidfds for are signalled, so a recycled pid is never hit.
+ */
+int signaljob(struct job_t *job, int sig)
+{
+    struct jobinfo_t *ji;
+    int k, sent = 0;
+
+    if (job == NULL)
+	return -1;
+    nsignals++;
+    ji = getjobinfo(job);
+    if (ji->cg && cg_signal(ji->cg, sig) == 0)	/* even ones that left the group */
+	return 0;
+    if (!ji->procs[0].done || !usepidfd)
+	return kill(-job->pid, sig);
+    for (k = 1; k < ji->nprocs; k++)
+	if (ji->procs[k].pidfd >= 0 &&
+	    pidfd_send_signal(ji->procs[k].pidfd, sig, NULL, 0) == 0)
+	    sent++;
+    return sent ? 0 : -1;
 }
 
 /* fgpid - Return PID of current foreground job, 0 if no such job */
 pid_t fgpid(struct job_t *jobs) {
-    int i;
-
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].state == FG)
-	    return jobs[i].pid;
-    return 0;
+    return fgjob < 0 ? 0 : jobs[fgjob].pid;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
+/* getjobpid  - Find the job (by PID of any of its processes) on the job list */
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
+    int b;
 
-    if (pid < 1)
+    if (pid < 1 || (b = pidhash_find(pid)) < 0)
 	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid)
-	    return &jobs[i];
-    return NULL;
+    return &jobs[pidhash[b].slot];
 }
 
 /* getjobjid  - Find a job (by JID) on the job list */
 struct job_t *getjobjid(struct job_t *jobs, int jid) 
 {
-    int i;
-
-    if (jid < 1)
+    if (jid < 1 || jid >= jidcap || jidmap[jid] < 0)
 	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid == jid)
-	    return &jobs[i];
-    return NULL;
+    return &jobs[jidmap[jid]];
 }
 
 /* pid2jid - Map process ID to job ID */
 int pid2jid(pid_t pid) 
 {
-    int i;
+    struct job_t *job = getjobpid(jobs, pid);
 
-    if (pid < 1)
-	return 0;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid) {
-            return jobs[i].jid;
-        }
-    return 0;
+    return job ? job->jid : 0;
 }
 
 /* listjobs - Print the job list */
 void listjobs(struct job_t *jobs) 
 {
-    int i;
+    char buf[64];
+    int i, jid;
     
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid != 0) {
-	    printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-	    switch (jobs[i].state) {
-		case BG: 
-		    printf("Running ");
-		    break;
-		case FG: 
-		    printf("Foreground ");
-		    break;
-		case ST: 
-		    printf("Stopped ");
-		    break;
-	    default:
-		    printf("listjobs: Internal error: job[%d].state=%d ", 
-			   i, jobs[i].state);
-	    }
-	    printf("%s", jobs[i].cmdline);
+    for (jid = 1; jid < nextjid; jid++) {
+	if ((i = jidmap[jid]) < 0)
+	    continue;
+	printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
+	switch (jobs[i].state) {
+	    case BG: 
+		printf("Running ");
+		break;
+	    case FG: 
+		printf("Foreground ");
+		break;
+	    case ST: 
+		printf("Stopped ");
+		break;
+	    case QU: 
+		printf("Queued ");
+		break;
+	default:
+		printf("listjobs: Internal error: job[%d].state=%d ", 
+		       i, jobs[i].state);
 	}
+	if (jobinfo[i].place)
+	    printf("cpus=%s ", jobinfo[i].place->text);
+	if (jobinfo[i].sched.flags)
+	    fputs(sched_text(buf, sizeof(buf), &jobinfo[i].sched), stdout);
+	fwrite(jobinfo[i].cmd->text, 1, jobinfo[i].cmd->len, stdout);
+    }
+}
+
+/* getusage - Convert a struct rusage into a struct usage_t */
+void getusage(struct usage_t *u, struct rusage *ru)
+{
+    u->utime = ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec;
+    u->stime = ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec;
+    u->maxrss = ru->ru_maxrss;
+    u->minflt = ru->ru_minflt;
+    u->majflt = ru->ru_majflt;
+    u->nvcsw = ru->ru_nvcsw;
+    u->nivcsw = ru->ru_nivcsw;
+}
+
+/* addusage - Add u into sum; the peak RSS is the largest of any process */
+void addusage(struct usage_t *sum, struct usage_t *u)
+{
+    sum->utime += u->utime;
+    sum->stime += u->stime;
+    if (u->maxrss > sum->maxrss)
+	sum->maxrss = u->maxrss;
+    sum->minflt += u->minflt;
+    sum->majflt += u->majflt;
+    sum->nvcsw += u->nvcsw;
+    sum->nivcsw += u->nivcsw;
+}
+
+/* recordjob - Remember a job that just finished in donejobs[] */
+void recordjob(struct job_t *job, int status, long long end)
+{
+    struct donejob_t *d = &donejobs[ndone++ % MAXDONE];
+
+    if (d->cmd)
+	cmdstr_put(d->cmd);
+    ring_free(d->ring);
+    d->jid = job->jid;
+    d->pid = job->pid;
+    d->status = status;
+    d->start = getjobinfo(job)->start;
+    d->end = end;
+    d->usage = getjobinfo(job)->usage;
+    d->cmd = getjobinfo(job)->cmd;	/* shared, not copied */
+    d->cmd->refs++;
+    d->ring = getjobinfo(job)->ring;	/* moved, for joblog */
+    getjobinfo(job)->ring = NULL;
+}
+
+/* getdonepid - Find a recently finished job by PID */
+struct donejob_t *getdonepid(pid_t pid)
+{
+    int i;
+
+    for (i = ndone-1; i >= 0 && i >= ndone-MAXDONE; i--)
+	if (donejobs[i % MAXDONE].pid == pid)
+	    return &donejobs[i % MAXDONE];
+    return NULL;
+}
+
+/*
+ * procusage - Add the CPU time and page faults a running process has
+ *    used so far, from /proc/<pid>/stat, into u
+ */
+static void procusage(pid_t pid, struct usage_t *u)
+{
+    char path[64], buf[1024], *p;
+    unsigned long minflt, majflt, utime, stime;
+    long hz = sysconf(_SC_CLK_TCK);
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	return;
+    n = read(fd, buf, sizeof(buf)-1);
+    close(fd);
+    if (n <= 0)
+	return;
+    buf[n] = '\0';
+
+    /* the fields after the command name, which may contain spaces */
+    if ((p = strrchr(buf, ')')) == NULL ||
+	sscanf(p+2, "%*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu",
+	       &minflt, &majflt, &utime, &stime) != 4)
+	return;
+    u->minflt += minflt;
+    u->majflt += majflt;
+    u->utime += utime * 1000000LL / hz;
+    u->stime += stime * 1000000LL / hz;
+}
+
+/* printusage - Print one job's resource usage line for jobs -l */
+static void printusage(long long wall, struct usage_t *u, int running)
+{
+    printf("    real %.3fs user %.3fs sys %.3fs", wall / 1e9,
+	   u->utime / 1e6, u->stime / 1e6);
+    if (running)		/* not known until the processes are reaped */
+	printf(" maxrss - csw -/-");
+    else
+	printf(" maxrss %ldk csw %ld/%ld", u->maxrss, u->nvcsw, u->nivcsw);
+    printf(" faults %ld/%ld\n", u->minflt, u->majflt);
+}
+
+/*
+ * listjobs_usage - Print the job list with each job's resource usage,
+ *    followed by the recently finished jobs
+ */
+void listjobs_usage(struct job_t *jobs) 
+{
+    struct usage_t u;
+    struct donejob_t *d;
+    long long now = now_ns();
+    int i, k, jid;
+
+    for (jid = 1; jid < nextjid; jid++) {
+	if ((i = jidmap[jid]) < 0)
+	    continue;
+	printf("[%d] (%d) %s %s", jobs[i].jid, jobs[i].pid,
+	       jobs[i].state == ST ? "Stopped" : jobs[i].state == QU ? "Queued" :
+	       jobs[i].state == FG ? "Foreground" : "Running", jobinfo[i].cmd->text);
+	u = jobinfo[i].usage;
+	for (k = 0; k < jobinfo[i].nprocs; k++)
+	    if (!jobinfo[i].procs[k].done)
+		procusage(jobinfo[i].procs[k].pid, &u);
+	printusage(now - jobinfo[i].start, &u, 1);
     }
+
+    for (i = ndone > MAXDONE ? ndone-MAXDONE : 0; i < ndone; i++) {
+	d = &donejobs[i % MAXDONE];
+	printf("[%d] (%d) ", d->jid, d->pid);
+	if (WIFSIGNALED(d->status))
+	    printf("Terminated by signal %d ", WTERMSIG(d->status));
+	else if (WEXITSTATUS(d->status))
+	    printf("Exit %d ", WEXITSTATUS(d->status));
+	else
+	    printf("Done ");
+	fwrite(d->cmd->text, 1, d->cmd->len, stdout);
+	printusage(d->end - d->start, &d->usage, 0);
+    }
+}
+
+/* printtimes - Report the times of a command run with the time prefix */
+void printtimes(long long wall, struct usage_t *u)
+{
+    printf("\nreal\t%lldm%.3fs\n", wall / 60000000000LL,
+	   (wall % 60000000000LL) / 1e9);
+    printf("user\t%lldm%.3fs\n", u->utime / 60000000, (u->utime % 60000000) / 1e6);
+    printf("sys\t%lldm%.3fs\n", u->stime / 60000000, (u->stime % 60000000) / 1e6);
 }
+
 /******************************
  * end job list helper routines
  ******************************/
@@ -719,10 +6501,25 @@ void listjobs(struct job_t *jobs)
  */
 void usage(void) 
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpfbdg] [-P n] [-S file] [-j n] [-A n] [-R n] [-C dir]\n");
+    printf("             [-a none|rr|least] [-c command | script]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -f   launch children with fork+exec instead of posix_spawn\n");
+    printf("   -b   run utilities named by path (/bin/echo) as builtins\n");
+    printf("   -d   run jobs bg sends to the background as SCHED_BATCH with idle I/O,\n");
+    printf("        until fg brings them back\n");
+    printf("   -g   run each job in a cgroup of its own, and stop it with cgroup.freeze\n");
+    printf("   -P n set the pipe buffer size of pipelines to n bytes\n");
+    printf("   -S f append latency statistics to file f at exit\n");
+    printf("   -j n queue background jobs while n jobs run (default: CPUs, 0: no limit)\n");
+    printf("   -A n reserve n bytes of disk past the end of files opened by > and >>\n");
+    printf("   -R n keep the last n bytes of output of jobs started with &! (default 64K)\n");
+    printf("   -C d keep scripts compiled in directory d, to skip parsing them next time\n");
+    printf("   -c s run the commands in string s and exit with the status of the last\n");
+    printf("   -a p place each background job on one CPU: rr takes them in turn across\n");
+    printf("        NUMA nodes, least takes the one with fewest jobs (default none)\n");
     exit(1);
 }
 
@@ -766,8 +6563,11 @@ handler_t *Signal(int signum, handler_t *handler)
  */
 void sigquit_handler(int sig) 
 {
-	printf("Terminating after receipt of SIGQUIT signal\n");
-	exit(1);
+	static char msg[] = "Terminating after receipt of SIGQUIT signal\n";
+
+	/* this one still runs in signal context, so no stdio */
+	write(STDOUT_FILENO,msg,sizeof(msg)-1);
+	_exit(1);
 }
 
 